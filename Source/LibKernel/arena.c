@@ -0,0 +1,134 @@
+#include "libkernel.h"
+
+#define K_ARENA_PAGE_SIZE 4096
+
+// Stored at the start of each chunk, chunks are linked from the newest to the oldest
+typedef struct k_arena_chunk_t {
+	struct k_arena_chunk_t *prev;
+	k_size_t size; // Usable bytes after the header
+	k_size_t used;
+	uint32_t padding16[1];
+} k_arena_chunk_t;
+
+k_static_assert(sizeof(k_arena_chunk_t) % 16 == 0);
+
+// There is a single CPU, so a single scratch arena
+static k_arena_t g_scratch_arena;
+
+void k_arena_init(k_arena_t *arena, k_size_t min_chunk_size, void *(*chunk_alloc)(uint32_t), void (*chunk_free)(void *, uint32_t)) {
+	k_assert(chunk_alloc != NULL && chunk_free != NULL, "Arena needs chunk allocation functions");
+
+	k_memset(arena, 0, sizeof(*arena));
+	arena->min_chunk_size = min_chunk_size;
+	arena->chunk_alloc = chunk_alloc;
+	arena->chunk_free = chunk_free;
+}
+
+static
+k_arena_chunk_t *push_chunk(k_arena_t *arena, k_size_t min_size) {
+	k_size_t size = k_max(arena->min_chunk_size, min_size + (k_size_t)sizeof(k_arena_chunk_t));
+	size = k_align_forward(size, K_ARENA_PAGE_SIZE);
+
+	k_arena_chunk_t *chunk = arena->chunk_alloc(size / K_ARENA_PAGE_SIZE);
+	if (!chunk) {
+		return NULL;
+	}
+
+	chunk->prev = arena->current;
+	chunk->size = size - sizeof(k_arena_chunk_t);
+	chunk->used = 0;
+
+	arena->current = chunk;
+	arena->num_reserved_bytes += size;
+
+	return chunk;
+}
+
+static
+void pop_chunk(k_arena_t *arena) {
+	k_arena_chunk_t *chunk = arena->current;
+
+	arena->current = chunk->prev;
+	arena->num_used_bytes -= chunk->used;
+	k_size_t size = chunk->size + sizeof(k_arena_chunk_t);
+	arena->num_reserved_bytes -= size;
+
+	arena->chunk_free(chunk, size / K_ARENA_PAGE_SIZE);
+}
+
+void *k_arena_alloc(k_arena_t *arena, k_size_t size) {
+	if (size <= 0) {
+		return NULL;
+	}
+
+	k_assert(arena->chunk_alloc != NULL, "Arena is not initialized");
+
+	size = k_align_forward(size, 16);
+
+	k_arena_chunk_t *chunk = arena->current;
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk = push_chunk(arena, size);
+		if (!chunk) {
+			return NULL;
+		}
+	}
+
+	void *ptr = (uint8_t *)(chunk + 1) + chunk->used;
+	chunk->used += size;
+
+	arena->num_used_bytes += size;
+	arena->peak_used_bytes = k_max(arena->peak_used_bytes, arena->num_used_bytes);
+
+	return ptr;
+}
+
+k_arena_mark_t k_arena_mark(k_arena_t *arena) {
+	k_arena_mark_t mark = {0};
+	mark.chunk = arena->current;
+	if (mark.chunk) {
+		mark.used = arena->current->used;
+	}
+
+	return mark;
+}
+
+// The oldest chunk is kept when resetting to the start, so that a reset per operation does not free and reallocate it
+void k_arena_reset_to(k_arena_t *arena, k_arena_mark_t mark) {
+	while (arena->current && arena->current != mark.chunk) {
+		if (!mark.chunk && !arena->current->prev) {
+			break;
+		}
+
+		pop_chunk(arena);
+	}
+
+	k_arena_chunk_t *chunk = arena->current;
+	if (!chunk) {
+		return;
+	}
+
+	k_size_t used = chunk == mark.chunk ? mark.used : 0;
+	k_assert(used <= chunk->used, "Invalid arena mark");
+
+	arena->num_used_bytes -= chunk->used - used;
+	chunk->used = used;
+}
+
+void k_arena_release(k_arena_t *arena) {
+	while (arena->current) {
+		pop_chunk(arena);
+	}
+}
+
+k_arena_t *k_get_scratch_arena(void) {
+	return &g_scratch_arena;
+}
+
+void k_arena_print_info(k_arena_t *arena, const char *name) {
+	int num_chunks = 0;
+	for (k_arena_chunk_t *chunk = arena->current; chunk; chunk = chunk->prev) {
+		num_chunks += 1;
+	}
+
+	k_printf("Arena %s: %n used, %n peak, %n reserved in %d chunk(s)\n", name, arena->num_used_bytes, arena->peak_used_bytes, arena->num_reserved_bytes, num_chunks);
+}
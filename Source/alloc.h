@@ -4,10 +4,14 @@
 #include "memory.h"
 
 #define KMALLOC_TOTAL_CAPACITY (4 * 1024 * 1024)
+#define KMALLOC_MAX_EMPTY_BINS 2 // Per size class, the pages of other empty bins are reclaimed
+#define KMALLOC_MAX_FREE_BIG_SLOTS 1 // Per big size class, the pages of other free slots are reclaimed
+#define KMALLOC_MAX_SIZE (1024 * 1024)
+#define KVMALLOC_MAX_KMALLOC_SIZE (64 * 1024) // Bigger kvmalloc allocations always use vmalloc
 
 #define VMALLOC_VIRT_MIN   KERNEL_VIRT_LINEAR_MAPPING_END
 #define VMALLOC_VIRT_START 0xe0000000
-#define VMALLOC_VIRT_END   0xffffffff
+#define VMALLOC_VIRT_END   (MEM_FIXED_MAPPING_START - 1)
 
 void kmalloc_init(void);
 void kmalloc_print_info(void);
@@ -15,13 +19,60 @@ void kmalloc_print_info(void);
 void *kmalloc(k_size_t size);
 void kfree(void *ptr);
 k_size_t ksize(void *ptr);
+// align must be a power of two, the block is freed with kfree
+void *kmalloc_aligned(k_size_t size, k_size_t align);
+// Zeroed allocation of count elements, NULL if count * size overflows
+void *kcalloc(k_size_t count, k_size_t size);
+// Grows in place when possible, the old block is kept on failure
+void *krealloc(void *ptr, k_size_t size);
+
+// Uses kmalloc when possible and vmalloc otherwise, kvfree and kvsize accept both
+void *kvmalloc(k_size_t size);
+void *kvcalloc(k_size_t count, k_size_t size);
+void kvfree(void *ptr);
+k_size_t kvsize(void *ptr);
+// Page runs without header, from kmalloc_pages when small enough and vmalloc otherwise
+void *kvmalloc_pages(uint32_t num_pages);
+void kvfree_pages(void *ptr, uint32_t num_pages);
+
+// Page aligned runs of pages from the kmalloc heap, without header
+void *kmalloc_pages(uint32_t num_pages);
+void kfree_pages(void *ptr, uint32_t num_pages);
+
+// Caches of objects of a single size, objects are kept constructed when ctor is not NULL
+typedef struct kmem_cache_t kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, k_size_t size, k_size_t align, void (*ctor)(void *));
+// Slabs come from page_alloc instead of kmalloc_pages, one page at a time
+kmem_cache_t *kmem_cache_create_with_page_source(const char *name, k_size_t size, k_size_t align, void (*ctor)(void *), void *(*page_alloc)(void), void (*page_free)(void *));
+// For callers that must not fail halfway through an operation
+bool kmem_cache_reserve(kmem_cache_t *cache, uint32_t num_objects);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *object);
+void kmem_cache_print_info(void);
 
 void vmalloc_init(void);
 void vmalloc_print_info(void);
 
 void *vmalloc(k_size_t size);
+// Only reserves address space, pages get a zeroed frame on first access
+void *vmalloc_lazy(k_size_t size);
+// Page aligned (or more) and without header, its address space keeps track of it
+void *vmalloc_aligned(k_size_t size, k_size_t align);
+// Lazy, the pages are unmapped and their frames freed by a later purge
 void vfree(void *ptr);
+// Unmap the lazily freed pages now
+void vmalloc_purge(void);
+// Grows in place when the address space after the allocation is free, the old block is kept on failure
+void *vrealloc(void *ptr, k_size_t size);
 k_size_t vsize(void *ptr);
+// Maps existing frames (physical addresses) contiguously without copying, the frames stay owned by the caller
+void *vmap(const uint32_t *frames, uint32_t num_frames, bool writable);
+// Unmaps a vmap area, without freeing its frames
+void vunmap(void *ptr);
+// Maps device memory (MMIO, framebuffers) with the given memory type, physical_addr does not need to be page aligned
+void *ioremap(uint32_t physical_addr, k_size_t size, mem_cache_mode_t cache_mode);
+void iounmap(void *ptr);
 void *vbrk(k_size_t increment);
 
 #endif // ALLOC_H
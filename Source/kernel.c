@@ -7,6 +7,7 @@
 #include "memory.h"
 #include "alloc.h"
 #include "tss.h"
+#include "vga.h"
 
 void k_assertion_failure(const char *expr, const char *msg, const char *func, const char *filename, int line, bool panic) {
 	k_print_stack();
@@ -62,6 +63,11 @@ void handle_page_fault(interrupt_registers_t registers) {
 
 	page_fault_t fault = *(page_fault_t *)&registers.error_code;
 
+	// First access to a demand-zero page
+	if (!fault.protection_violation && mem_handle_page_fault(virt_addr, fault.user)) {
+		return;
+	}
+
 	const char *access = fault.write_access ? "writing" : "reading";
 	k_printf("Page fault when accessing address %p for %s (error code is %p)\n", virt_addr, access, registers.error_code);
 
@@ -94,6 +100,8 @@ void kernel_main(uint32_t magic_number, const multiboot_info_t *multiboot_info)
 	mem_init_with_multiboot_info(multiboot_info);
 	kmalloc_init();
 	vmalloc_init();
+	k_arena_init(k_get_scratch_arena(), K_SCRATCH_ARENA_CHUNK_SIZE, kvmalloc_pages, kvfree_pages);
+	vga_remap_buffer();
 	kb_initialize();
 
 	tty_clear(0);
@@ -5,11 +5,15 @@
 // Kmalloc manages bins. Each bin manages a list of allocation
 // There are two different types of allocations in kmalloc:
 //
-// 1- small allocations (< page size): we allocate a page worth of memory, and fragment that
-// page with as many fixed size blocks as possible. The bin is put at the
-// top of the page, and added to the list of bins. The size of the allocations
-// is one of a fixed set of size class, each allocation request is rounded up
-// to the next size class.
+// 1- small allocations (<= 2 KiB): we allocate a page (or a few pages for the biggest
+// classes) worth of memory, and fragment it with as many fixed size blocks as possible.
+// The bin is put at the top of its first page, and added to the list of bins. The size
+// of the allocations is one of a fixed set of size class, each allocation request is
+// rounded up to the next size class. Small allocations have no header: the bin is found
+// by rounding the pointer down to the page, and free blocks are linked through their
+// own first bytes (the page kinds give the offset of a page in a multi-page bin).
+// Each size class keeps its bins in three lists (empty, partial and full) so that
+// allocating and freeing never walk the bins.
 //
 // 2- big allocations (>= page size): for big allocations we have only one bin per size class.
 // All bins are stored statically inside the kmalloc_heap_t structure, not
@@ -17,8 +21,24 @@
 // are not preallocated, though once a big allocation is made, the slot is reused
 // for the next allocations if it has been freed.
 //
-// For both small and big allocations, a header is put at the start of the block
-// of memory to store necessary metadata (the bin and size, prev and next ptrs).
+// For big allocations, a header is put at the start of the block of memory to store
+// necessary metadata (the bin and size, prev and next ptrs).
+//
+// 3- large allocations (> 16 KiB): power of two slots would waste up to half of the block,
+// so large allocations get a run of exactly as many pages as they need (with the same
+// header, without bin). Their pages go back to the pool as soon as they are freed.
+//
+// Aligned allocations (see kmalloc_aligned) are small allocations padded so that an aligned
+// pointer fits inside the block, or page runs without header, whose length is given by
+// the kinds of their pages.
+//
+// Since a small allocation can also start right after the top of a page, we keep the
+// kind of every page of the heap to know which one we are freeing.
+//
+// Pages are taken from a pool of free page runs shared by all size classes before
+// growing the heap. A size class keeps at most KMALLOC_MAX_EMPTY_BINS empty bins and
+// KMALLOC_MAX_FREE_BIG_SLOTS free big slots, the pages of the others go back to the pool,
+// and a run at the top of the heap goes back to the heap itself.
 
 typedef struct kmalloc_header_t {
 	struct kmalloc_header_t *prev;
@@ -29,28 +49,69 @@ typedef struct kmalloc_header_t {
 
 k_static_assert(sizeof(kmalloc_header_t) % 16 == 0);
 
+// Classes grow by 1.5x or 1.33x steps above 48 bytes. The worst case for a class is a
+// request one byte bigger than the previous class, which wastes (class - prev - 1) / class:
+// just under 1/3 after a 1.5x step and 1/4 after a 1.33x step. The 16 byte steps of the
+// first classes waste up to 15 bytes, which is a lot for the smallest requests.
+// Each class lists its worst case waste, for the smallest request it gets
 static const k_size_t g_kmalloc_size_classes[] = {
-	64, 128, 256, 512, 1024,
+	  16, //   15 B for    1 B: 94%
+	  32, //   15 B for   17 B: 47%
+	  48, //   15 B for   33 B: 31%
+	  64, //   15 B for   49 B: 23%
+	  96, //   31 B for   65 B: 32%
+	 128, //   31 B for   97 B: 24%
+	 192, //   63 B for  129 B: 33%
+	 256, //   63 B for  193 B: 25%
+	 384, //  127 B for  257 B: 33%
+	 512, //  127 B for  385 B: 25%
+	 768, //  255 B for  513 B: 33%
+	1024, //  255 B for  769 B: 25%
+	1536, //  511 B for 1025 B: 33%
+	2048, //  511 B for 1537 B: 25%
 };
 
+// Big classes double, so they waste just under half of the block at worst (2049 bytes in
+// the 4k class). Above 16 KiB, large allocations only round up to a page
 static const k_size_t g_kmalloc_big_size_classes[] = {
 	     4096 - sizeof(kmalloc_header_t), //   4k
 	 2 * 4096 - sizeof(kmalloc_header_t), //   8k
 	 4 * 4096 - sizeof(kmalloc_header_t), //  16k
-	 8 * 4096 - sizeof(kmalloc_header_t), //  32k
-	16 * 4096 - sizeof(kmalloc_header_t), //  64k
-	32 * 4096 - sizeof(kmalloc_header_t), // 128k
 };
 
 #define NUM_KMALLOC_SIZE_CLASSES k_array_count(g_kmalloc_size_classes)
 #define NUM_KMALLOC_BIG_SIZE_CLASSES k_array_count(g_kmalloc_big_size_classes)
-#define NUM_KMALLOC_DEFAULT_BINS 3
+#define NUM_KMALLOC_DEFAULT_BINS 1
+
+// A bin of a big class spans several pages when a single page would leave more than
+// 1/KMALLOC_MAX_BIN_WASTE_RATIO of the bin unused (e.g. a single 2 KiB block per page)
+#define KMALLOC_MAX_BIN_PAGES 4
+#define KMALLOC_MAX_BIN_WASTE_RATIO 8
+
+// Small size classes indexed by (size + 15) / 16, computed by kmalloc_init
+static uint8_t g_kmalloc_size_class_lookup[2048 / 16 + 1];
+static uint8_t g_kmalloc_bin_num_pages[k_array_count(g_kmalloc_size_classes)];
+
+typedef struct kmalloc_free_block_t {
+	struct kmalloc_free_block_t *next;
+} kmalloc_free_block_t;
+
+typedef enum kmalloc_bin_state_t {
+	KMALLOC_BIN_EMPTY,
+	KMALLOC_BIN_PARTIAL,
+	KMALLOC_BIN_FULL,
+	KMALLOC_NUM_BIN_STATES,
+} kmalloc_bin_state_t;
 
 typedef struct kmalloc_bin_t {
+	struct kmalloc_bin_t *prev;
 	struct kmalloc_bin_t *next;
+	kmalloc_free_block_t *free_list;
 	k_size_t alloc_size;
-	kmalloc_header_t *free_list;
-	kmalloc_header_t *occupied_list;
+	uint32_t size_class;
+	uint32_t num_slots;
+	uint32_t num_used_slots;
+	uint32_t padding16[1];
 } kmalloc_bin_t;
 
 k_static_assert(sizeof(kmalloc_bin_t) % 16 == 0);
@@ -59,18 +120,58 @@ typedef struct kmalloc_big_bin_t {
 	struct kmalloc_header_t *free_list;
 	struct kmalloc_header_t *occupied_list;
 	k_size_t alloc_size;
+	uint32_t num_free_slots;
 } kmalloc_big_bin_t;
 
+// Stored at the start of the free run
+typedef struct kmalloc_page_run_t {
+	struct kmalloc_page_run_t *next;
+	uint32_t num_pages;
+} kmalloc_page_run_t;
+
+typedef enum kmalloc_page_kind_t {
+	KMALLOC_PAGE_NONE,
+	KMALLOC_PAGE_BIG,     // First page of a big allocation
+	KMALLOC_PAGE_LARGE,   // First page of a large allocation
+	KMALLOC_PAGE_ALIGNED, // First page of an aligned page run
+	KMALLOC_PAGE_ALIGNED_NEXT, // Next pages of an aligned page run
+	KMALLOC_PAGE_BIN,     // First page of a small allocation bin, the next pages of the bin are KMALLOC_PAGE_BIN + their index
+} kmalloc_page_kind_t;
+
+// The heap lives in the kernel linear mapping, which is what kbrk grows
+#define KMALLOC_NUM_HEAP_PAGES ((KERNEL_VIRT_LINEAR_MAPPING_END - KERNEL_VIRT_LINEAR_MAPPING_START) / MEM_PAGE_SIZE)
+
 typedef struct kmalloc_heap_t {
 	uint8_t *end_addr;
 	uint8_t *curr_addr;
 
-	kmalloc_bin_t *bin_list[NUM_KMALLOC_SIZE_CLASSES];
+	uint8_t page_kinds[KMALLOC_NUM_HEAP_PAGES]; // kmalloc_page_kind_t
+
+	kmalloc_page_run_t *free_page_runs; // Sorted by address
+	uint32_t num_free_pages;
+	uint32_t num_reclaimed_bytes; // Total returned to the page pool
+
+	kmalloc_bin_t *bin_lists[NUM_KMALLOC_SIZE_CLASSES][KMALLOC_NUM_BIN_STATES];
+	uint32_t num_bins[NUM_KMALLOC_SIZE_CLASSES][KMALLOC_NUM_BIN_STATES];
 	kmalloc_big_bin_t big_bin_list[NUM_KMALLOC_BIG_SIZE_CLASSES];
+
+	kmalloc_header_t *large_list;
+	uint32_t num_large_pages;
 } kmalloc_heap_t;
 
 static kmalloc_heap_t g_kmalloc_heap;
 
+static
+uint8_t *get_page_kind(kmalloc_heap_t *heap, void *ptr) {
+	uint32_t addr = (uint32_t)ptr;
+	k_assert(addr >= KERNEL_VIRT_LINEAR_MAPPING_START && addr < KERNEL_VIRT_LINEAR_MAPPING_END, "Invalid ptr");
+
+	return &heap->page_kinds[(addr - KERNEL_VIRT_LINEAR_MAPPING_START) / MEM_PAGE_SIZE];
+}
+
+static
+void insert_page_run(kmalloc_heap_t *heap, void *ptr, uint32_t num_pages);
+
 static
 bool extend_heap(kmalloc_heap_t *heap, k_size_t increment) {
 	uint8_t *current_brk = kbrk(0);
@@ -79,15 +180,163 @@ bool extend_heap(kmalloc_heap_t *heap, k_size_t increment) {
 		return false;
 	}
 
-	// In case other subsystems used kbrk, we make sure to discard our previous blocks of memory
+	// In case other subsystems used kbrk, the heap moves to the new region
+	// The pages we had not used yet go to the pool
 	if (current_brk != heap->end_addr) {
+		uint8_t *unused_start = heap->curr_addr;
+		uint8_t *unused_end = heap->end_addr;
+
 		heap->curr_addr = current_brk;
 		heap->end_addr = kbrk(0);
+
+		if (unused_start < unused_end) {
+			uint32_t num_pages = (unused_end - unused_start) / MEM_PAGE_SIZE;
+			uint32_t num_free_pages = heap->num_free_pages;
+			insert_page_run(heap, unused_start, num_pages);
+			k_assert(heap->num_free_pages == num_free_pages + num_pages, "Unused heap pages did not go to the pool");
+		}
+	} else {
+		heap->end_addr = kbrk(0);
 	}
 
 	return true;
 }
 
+// Take the num_pages pages starting at ptr if they are free, from the pool or the top of the heap
+static
+bool alloc_pages_at(kmalloc_heap_t *heap, void *ptr, uint32_t num_pages) {
+	uint8_t *start = ptr;
+	uint8_t *end = start + num_pages * MEM_PAGE_SIZE;
+
+	if (start == heap->curr_addr) {
+		if (end > heap->end_addr && !extend_heap(heap, end - heap->end_addr)) {
+			return false;
+		}
+
+		// Another subsystem may have used kbrk, leaving our pages behind
+		if (start != heap->curr_addr) {
+			return false;
+		}
+
+		heap->curr_addr = end;
+
+		return true;
+	}
+
+	kmalloc_page_run_t **link = &heap->free_page_runs;
+	while (*link && (uint8_t *)*link < start) {
+		link = &(*link)->next;
+	}
+
+	kmalloc_page_run_t *run = *link;
+	if ((uint8_t *)run != start || run->num_pages < num_pages) {
+		return false;
+	}
+
+	heap->num_free_pages -= num_pages;
+
+	if (run->num_pages > num_pages) {
+		kmalloc_page_run_t *rest = (kmalloc_page_run_t *)end;
+		rest->next = run->next;
+		rest->num_pages = run->num_pages - num_pages;
+		*link = rest;
+	} else {
+		*link = run->next;
+	}
+
+	return true;
+}
+
+// Take the first run of the pool that is big enough, or grow the heap
+static
+void *alloc_pages(kmalloc_heap_t *heap, uint32_t num_pages) {
+	kmalloc_page_run_t **link = &heap->free_page_runs;
+	for (kmalloc_page_run_t *run = *link; run; link = &run->next, run = *link) {
+		if (run->num_pages < num_pages) {
+			continue;
+		}
+
+		// Take the start of the run, so that the pages after the allocation are free to grow into
+		alloc_pages_at(heap, run, num_pages);
+
+		return run;
+	}
+
+	k_size_t size = num_pages * MEM_PAGE_SIZE;
+	if (heap->curr_addr + size > heap->end_addr) {
+		if (!extend_heap(heap, size)) {
+			return NULL;
+		}
+	}
+
+	void *ptr = heap->curr_addr;
+	heap->curr_addr += size;
+
+	return ptr;
+}
+
+static
+void free_pages(kmalloc_heap_t *heap, void *ptr, uint32_t num_pages) {
+	for (uint32_t i = 0; i < num_pages; i += 1) {
+		*get_page_kind(heap, (uint8_t *)ptr + i * MEM_PAGE_SIZE) = KMALLOC_PAGE_NONE;
+	}
+	heap->num_reclaimed_bytes += num_pages * MEM_PAGE_SIZE;
+
+	// Give the pages back to the heap if they are at its top
+	if ((uint8_t *)ptr + num_pages * MEM_PAGE_SIZE == heap->curr_addr) {
+		heap->curr_addr = ptr;
+
+		// This may expose the last run of the pool
+		kmalloc_page_run_t **link = &heap->free_page_runs;
+		while (*link && (*link)->next) {
+			link = &(*link)->next;
+		}
+
+		kmalloc_page_run_t *last = *link;
+		if (last && (uint8_t *)last + last->num_pages * MEM_PAGE_SIZE == heap->curr_addr) {
+			heap->curr_addr = (uint8_t *)last;
+			heap->num_free_pages -= last->num_pages;
+			*link = NULL;
+		}
+
+		return;
+	}
+
+	insert_page_run(heap, ptr, num_pages);
+}
+
+// Add the pages to the pool, merged with their neighbouring runs
+static
+void insert_page_run(kmalloc_heap_t *heap, void *ptr, uint32_t num_pages) {
+	kmalloc_page_run_t *run = ptr;
+	run->num_pages = num_pages;
+	heap->num_free_pages += num_pages;
+
+	kmalloc_page_run_t *prev = NULL;
+	kmalloc_page_run_t *next = heap->free_page_runs;
+	while (next && next < run) {
+		prev = next;
+		next = next->next;
+	}
+
+	// Merge with the next run
+	if (next && (uint8_t *)run + run->num_pages * MEM_PAGE_SIZE == (uint8_t *)next) {
+		run->num_pages += next->num_pages;
+		next = next->next;
+	}
+	run->next = next;
+
+	// Merge with the previous run
+	if (prev && (uint8_t *)prev + prev->num_pages * MEM_PAGE_SIZE == (uint8_t *)run) {
+		prev->num_pages += run->num_pages;
+		prev->next = run->next;
+	} else if (prev) {
+		prev->next = run;
+	} else {
+		heap->free_page_runs = run;
+	}
+}
+
 static
 void alloc_push_front(kmalloc_header_t **first, kmalloc_header_t *header) {
 	if (!first) {
@@ -148,24 +397,108 @@ bool is_big_size_class(k_size_t size) {
 
 static
 int get_size_class(k_size_t alloc_size) {
-	for (int i = 0; i < (int)NUM_KMALLOC_SIZE_CLASSES; i += 1) {
-		if (alloc_size <= g_kmalloc_size_classes[i]) {
-			return i;
-		}
+	if (alloc_size <= 0 || is_big_size_class(alloc_size)) {
+		return -1;
 	}
 
-	return -1;
+	return g_kmalloc_size_class_lookup[(alloc_size + 15) >> 4];
 }
 
+// Big classes are powers of two pages
 static
 int get_big_size_class(k_size_t alloc_size) {
-	for (int i = 0; i < (int)NUM_KMALLOC_BIG_SIZE_CLASSES; i += 1) {
-		if (alloc_size <= g_kmalloc_big_size_classes[i]) {
-			return i;
+	uint32_t num_pages = (alloc_size + sizeof(kmalloc_header_t) + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE;
+	int size_class = num_pages <= 1 ? 0 : 32 - __builtin_clz(num_pages - 1);
+	if (size_class >= (int)NUM_KMALLOC_BIG_SIZE_CLASSES) {
+		return -1;
+	}
+
+	return size_class;
+}
+
+static
+void init_size_classes(void) {
+	int size_class = 0;
+	for (int i = 0; i < (int)k_array_count(g_kmalloc_size_class_lookup); i += 1) {
+		while (g_kmalloc_size_classes[size_class] < (k_size_t)i * 16) {
+			size_class += 1;
 		}
+		g_kmalloc_size_class_lookup[i] = size_class;
+	}
+
+	for (int i = 0; i < (int)NUM_KMALLOC_SIZE_CLASSES; i += 1) {
+		k_size_t alloc_size = g_kmalloc_size_classes[i];
+
+		uint32_t num_pages = 1;
+		while (num_pages < KMALLOC_MAX_BIN_PAGES) {
+			k_size_t bin_size = num_pages * MEM_PAGE_SIZE;
+			k_size_t waste = (bin_size - sizeof(kmalloc_bin_t)) % alloc_size + sizeof(kmalloc_bin_t);
+			if (waste * KMALLOC_MAX_BIN_WASTE_RATIO <= bin_size) {
+				break;
+			}
+
+			num_pages *= 2;
+		}
+
+		g_kmalloc_bin_num_pages[i] = num_pages;
+	}
+}
+
+static
+kmalloc_bin_state_t get_bin_state(kmalloc_bin_t *bin) {
+	if (bin->num_used_slots == 0) {
+		return KMALLOC_BIN_EMPTY;
+	}
+
+	if (bin->num_used_slots == bin->num_slots) {
+		return KMALLOC_BIN_FULL;
+	}
+
+	return KMALLOC_BIN_PARTIAL;
+}
+
+static
+void bin_push_front(kmalloc_heap_t *heap, kmalloc_bin_t *bin) {
+	kmalloc_bin_state_t state = get_bin_state(bin);
+	kmalloc_bin_t **first = &heap->bin_lists[bin->size_class][state];
+	heap->num_bins[bin->size_class][state] += 1;
+
+	bin->prev = NULL;
+	bin->next = *first;
+	if (bin->next) {
+		bin->next->prev = bin;
 	}
+	*first = bin;
+}
+
+static
+void bin_pop(kmalloc_heap_t *heap, kmalloc_bin_t *bin, kmalloc_bin_state_t state) {
+	kmalloc_bin_t **first = &heap->bin_lists[bin->size_class][state];
+	heap->num_bins[bin->size_class][state] -= 1;
 
-	return -1;
+	if (*first == bin) {
+		*first = bin->next;
+	}
+
+	if (bin->prev) {
+		bin->prev->next = bin->next;
+	}
+
+	if (bin->next) {
+		bin->next->prev = bin->prev;
+	}
+
+	bin->prev = NULL;
+	bin->next = NULL;
+}
+
+// Move the bin to the list of its current state, if it is not in it anymore
+static
+void bin_update_list(kmalloc_heap_t *heap, kmalloc_bin_t *bin, kmalloc_bin_state_t prev_state) {
+	if (get_bin_state(bin) != prev_state) {
+		bin_pop(heap, bin, prev_state);
+		bin_push_front(heap, bin);
+	}
 }
 
 static
@@ -174,45 +507,32 @@ kmalloc_bin_t *create_bin(kmalloc_heap_t *heap, k_size_t alloc_size) {
 	k_assert(size_class >= 0, "Invalid size class");
 
 	alloc_size = g_kmalloc_size_classes[size_class];
+	uint32_t num_pages = g_kmalloc_bin_num_pages[size_class];
 
-	if (heap->curr_addr + MEM_PAGE_SIZE > heap->end_addr) {
-		if (!extend_heap(heap, MEM_PAGE_SIZE)) {
-			return NULL;
-		}
-	}
-
-	kmalloc_bin_t *bin = (kmalloc_bin_t *)heap->curr_addr;
+	kmalloc_bin_t *bin = alloc_pages(heap, num_pages);
 	if (!bin) {
 		return NULL;
 	}
 
-	heap->curr_addr += MEM_PAGE_SIZE;
 	k_memset(bin, 0, sizeof(*bin));
-
-	bin->next = heap->bin_list[size_class];
-	heap->bin_list[size_class] = bin;
+	for (uint32_t i = 0; i < num_pages; i += 1) {
+		*get_page_kind(heap, (uint8_t *)bin + i * MEM_PAGE_SIZE) = KMALLOC_PAGE_BIN + i;
+	}
 
 	bin->alloc_size = alloc_size;
-	bin->free_list = (kmalloc_header_t *)(bin + 1);
-
-	kmalloc_header_t *prev = bin->free_list;
-	k_memset(prev, 0, sizeof(*prev));
-	prev->bin = bin;
-	prev->size = alloc_size;
-
-	k_size_t size_with_header = alloc_size + sizeof(kmalloc_header_t);
-	k_size_t num_slots = (MEM_PAGE_SIZE - sizeof(*bin)) / size_with_header;
-	for (k_size_t i = 1; i < num_slots; i += 1) {
-		kmalloc_header_t *header = (kmalloc_header_t *)((uint8_t *)bin->free_list + i * size_with_header);
-		prev->next = header;
-		header->prev = prev;
-		header->next = NULL;
-		header->bin = bin;
-		header->size = alloc_size;
-
-		prev = header;
+	bin->size_class = size_class;
+	bin->num_slots = (num_pages * MEM_PAGE_SIZE - sizeof(*bin)) / alloc_size;
+
+	// Link the free blocks in address order
+	uint8_t *slots = (uint8_t *)(bin + 1);
+	for (k_size_t i = bin->num_slots; i > 0; i -= 1) {
+		kmalloc_free_block_t *block = (kmalloc_free_block_t *)(slots + (i - 1) * alloc_size);
+		block->next = bin->free_list;
+		bin->free_list = block;
 	}
 
+	bin_push_front(heap, bin);
+
 	k_printf("Created kmalloc bin for size %d (class %d)\n", alloc_size, size_class);
 
 	return bin;
@@ -225,37 +545,76 @@ kmalloc_bin_t *get_bin(kmalloc_heap_t *heap, k_size_t alloc_size) {
 		return NULL;
 	}
 
-	for (kmalloc_bin_t *bin = heap->bin_list[class]; bin; bin = bin->next) {
-		if (bin->free_list) {
-			return bin;
-		}
+	// Fill partial bins first, so that empty bins stay empty
+	if (heap->bin_lists[class][KMALLOC_BIN_PARTIAL]) {
+		return heap->bin_lists[class][KMALLOC_BIN_PARTIAL];
 	}
 
-	return NULL;
+	return heap->bin_lists[class][KMALLOC_BIN_EMPTY];
 }
 
 static
-void *bin_alloc(kmalloc_bin_t *bin) {
-	kmalloc_header_t *alloc = alloc_pop_front(&bin->free_list);
-	if (!alloc) {
+kmalloc_bin_t *get_bin_of_ptr(kmalloc_heap_t *heap, void *ptr) {
+	uint32_t page_addr = (uint32_t)ptr & ~(uint32_t)(MEM_PAGE_SIZE - 1);
+	uint8_t kind = *get_page_kind(heap, ptr);
+	k_assert(kind >= KMALLOC_PAGE_BIN, "Invalid ptr");
+
+	return (kmalloc_bin_t *)(page_addr - (kind - KMALLOC_PAGE_BIN) * MEM_PAGE_SIZE);
+}
+
+static
+void *bin_alloc(kmalloc_heap_t *heap, kmalloc_bin_t *bin) {
+	kmalloc_free_block_t *block = bin->free_list;
+	if (!block) {
 		return NULL;
 	}
 
-	alloc_push_front(&bin->occupied_list, alloc);
+	kmalloc_bin_state_t prev_state = get_bin_state(bin);
 
-	return (void *)(alloc + 1);
+	bin->free_list = block->next;
+	bin->num_used_slots += 1;
+
+	bin_update_list(heap, bin, prev_state);
+
+	return block;
 }
 
+// Aligned allocations point inside their block
 static
-void bin_free(kmalloc_bin_t *bin, kmalloc_header_t *alloc) {
-	alloc_pop(&bin->occupied_list, alloc);
-	alloc_push_front(&bin->free_list, alloc);
+void *get_block_of_ptr(kmalloc_bin_t *bin, void *ptr) {
+	k_assert((uint32_t)ptr >= (uint32_t)(bin + 1), "Invalid ptr");
+
+	uint32_t offset = (uint32_t)ptr - (uint32_t)(bin + 1);
+	k_assert(offset / bin->alloc_size < bin->num_slots, "Invalid ptr");
+
+	return (uint8_t *)(bin + 1) + offset - offset % bin->alloc_size;
+}
+
+static
+void bin_free(kmalloc_heap_t *heap, kmalloc_bin_t *bin, void *ptr) {
+	k_assert(bin->num_used_slots > 0, "Double free");
+
+	kmalloc_bin_state_t prev_state = get_bin_state(bin);
+
+	kmalloc_free_block_t *block = get_block_of_ptr(bin, ptr);
+	block->next = bin->free_list;
+	bin->free_list = block;
+	bin->num_used_slots -= 1;
+
+	bin_update_list(heap, bin, prev_state);
+
+	// Release the bin if its class already has enough empty ones
+	if (bin->num_used_slots == 0 && heap->num_bins[bin->size_class][KMALLOC_BIN_EMPTY] > KMALLOC_MAX_EMPTY_BINS) {
+		bin_pop(heap, bin, KMALLOC_BIN_EMPTY);
+		free_pages(heap, bin, g_kmalloc_bin_num_pages[bin->size_class]);
+	}
 }
 
 static
 void *big_alloc(kmalloc_heap_t *heap, kmalloc_big_bin_t *bin) {
 	kmalloc_header_t *alloc = alloc_pop_front(&bin->free_list);
 	if (alloc) {
+		bin->num_free_slots -= 1;
 		alloc_push_front(&bin->occupied_list, alloc);
 
 		return (void *)(alloc + 1);
@@ -263,18 +622,12 @@ void *big_alloc(kmalloc_heap_t *heap, kmalloc_big_bin_t *bin) {
 
 	k_size_t size_with_header = bin->alloc_size + sizeof(kmalloc_header_t);
 
-	if (heap->curr_addr + size_with_header > heap->end_addr) {
-		if (!extend_heap(heap, size_with_header)) {
-			return NULL;
-		}
-	}
-
-	void *ptr = heap->curr_addr;
+	void *ptr = alloc_pages(heap, size_with_header / MEM_PAGE_SIZE);
 	if (!ptr) {
 		return NULL;
 	}
 
-	heap->curr_addr += size_with_header;
+	*get_page_kind(heap, ptr) = KMALLOC_PAGE_BIG;
 
 	alloc = (kmalloc_header_t *)ptr;
 	alloc->size = bin->alloc_size;
@@ -285,9 +638,103 @@ void *big_alloc(kmalloc_heap_t *heap, kmalloc_big_bin_t *bin) {
 }
 
 static
-void big_free(kmalloc_big_bin_t *bin, kmalloc_header_t *alloc) {
+void big_free(kmalloc_heap_t *heap, kmalloc_big_bin_t *bin, kmalloc_header_t *alloc) {
 	alloc_pop(&bin->occupied_list, alloc);
+
+	if (bin->num_free_slots >= KMALLOC_MAX_FREE_BIG_SLOTS) {
+		free_pages(heap, alloc, (bin->alloc_size + sizeof(kmalloc_header_t)) / MEM_PAGE_SIZE);
+		return;
+	}
+
 	alloc_push_front(&bin->free_list, alloc);
+	bin->num_free_slots += 1;
+}
+
+static
+void *large_alloc(kmalloc_heap_t *heap, k_size_t size) {
+	uint32_t num_pages = (size + sizeof(kmalloc_header_t) + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE;
+
+	kmalloc_header_t *alloc = alloc_pages(heap, num_pages);
+	if (!alloc) {
+		return NULL;
+	}
+
+	*get_page_kind(heap, alloc) = KMALLOC_PAGE_LARGE;
+
+	alloc->size = num_pages * MEM_PAGE_SIZE - sizeof(kmalloc_header_t);
+	alloc->bin = NULL;
+	alloc_push_front(&heap->large_list, alloc);
+	heap->num_large_pages += num_pages;
+
+	return (void *)(alloc + 1);
+}
+
+static
+void large_free(kmalloc_heap_t *heap, kmalloc_header_t *alloc) {
+	uint32_t num_pages = (alloc->size + sizeof(kmalloc_header_t)) / MEM_PAGE_SIZE;
+
+	alloc_pop(&heap->large_list, alloc);
+	heap->num_large_pages -= num_pages;
+
+	free_pages(heap, alloc, num_pages);
+}
+
+// Grow a large allocation with the pages that follow it, if they are free
+static
+bool large_grow(kmalloc_heap_t *heap, kmalloc_header_t *alloc, k_size_t size) {
+	uint32_t num_pages = (alloc->size + sizeof(kmalloc_header_t)) / MEM_PAGE_SIZE;
+	uint32_t new_num_pages = (size + sizeof(kmalloc_header_t) + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE;
+
+	if (!alloc_pages_at(heap, (uint8_t *)alloc + num_pages * MEM_PAGE_SIZE, new_num_pages - num_pages)) {
+		return false;
+	}
+
+	alloc->size = new_num_pages * MEM_PAGE_SIZE - sizeof(kmalloc_header_t);
+	heap->num_large_pages += new_num_pages - num_pages;
+
+	return true;
+}
+
+static
+uint32_t get_aligned_num_pages(kmalloc_heap_t *heap, void *ptr) {
+	uint32_t num_pages = 1;
+	while ((uint8_t *)ptr + num_pages * MEM_PAGE_SIZE < heap->curr_addr
+		&& *get_page_kind(heap, (uint8_t *)ptr + num_pages * MEM_PAGE_SIZE) == KMALLOC_PAGE_ALIGNED_NEXT) {
+		num_pages += 1;
+	}
+
+	return num_pages;
+}
+
+// Over-allocate, then give back the pages before and after the aligned run
+static
+void *aligned_pages_alloc(kmalloc_heap_t *heap, k_size_t size, k_size_t align) {
+	uint32_t num_pages = (size + MEM_PAGE_SIZE - 1) / MEM_PAGE_SIZE;
+	uint32_t num_extra_pages = align / MEM_PAGE_SIZE - 1;
+
+	uint8_t *run = alloc_pages(heap, num_pages + num_extra_pages);
+	if (!run) {
+		return NULL;
+	}
+
+	uint8_t *ptr = (uint8_t *)k_align_forward((uint32_t)run, (uint32_t)align);
+	uint32_t num_pages_before = (ptr - run) / MEM_PAGE_SIZE;
+	uint32_t num_pages_after = num_extra_pages - num_pages_before;
+
+	// Free the pages after first, they may go back to the top of the heap
+	if (num_pages_after > 0) {
+		free_pages(heap, ptr + num_pages * MEM_PAGE_SIZE, num_pages_after);
+	}
+	if (num_pages_before > 0) {
+		free_pages(heap, run, num_pages_before);
+	}
+
+	*get_page_kind(heap, ptr) = KMALLOC_PAGE_ALIGNED;
+	for (uint32_t i = 1; i < num_pages; i += 1) {
+		*get_page_kind(heap, ptr + i * MEM_PAGE_SIZE) = KMALLOC_PAGE_ALIGNED_NEXT;
+	}
+
+	return ptr;
 }
 
 void kmalloc_init(void) {
@@ -295,6 +742,8 @@ void kmalloc_init(void) {
 		k_panic("Could not initialize kmalloc");
 	}
 
+	init_size_classes();
+
 	for (int i = 0; i < (int)NUM_KMALLOC_BIG_SIZE_CLASSES; i += 1) {
 		kmalloc_big_bin_t *bin = &g_kmalloc_heap.big_bin_list[i];
 		bin->alloc_size = g_kmalloc_big_size_classes[i];
@@ -312,11 +761,13 @@ void kmalloc_init(void) {
 }
 
 void *kmalloc(k_size_t size) {
-	if (size <= 0 || size > g_kmalloc_big_size_classes[NUM_KMALLOC_BIG_SIZE_CLASSES - 1]) {
+	if (size <= 0 || size > KMALLOC_MAX_SIZE) {
 		return NULL;
 	}
 
-	if (is_big_size_class(size)) {
+	if (size > g_kmalloc_big_size_classes[NUM_KMALLOC_BIG_SIZE_CLASSES - 1]) {
+		return large_alloc(&g_kmalloc_heap, size);
+	} else if (is_big_size_class(size)) {
 		int size_class = get_big_size_class(size);
 		k_assert(size_class >= 0, "");
 
@@ -333,56 +784,262 @@ void *kmalloc(k_size_t size) {
 			}
 		}
 
-		return bin_alloc(bin);
+		return bin_alloc(&g_kmalloc_heap, bin);
 	}
 }
 
 void kfree(void *ptr) {
-	kmalloc_header_t *header = (kmalloc_header_t *)ptr - 1;
-
-	k_assert(header->bin != NULL, "Invalid ptr");
+	if (!ptr) {
+		return;
+	}
 
-	if (is_big_size_class(header->size)) {
-		big_free((kmalloc_big_bin_t *)header->bin, header);
+	uint8_t kind = *get_page_kind(&g_kmalloc_heap, ptr);
+	if (kind >= KMALLOC_PAGE_BIN) {
+		bin_free(&g_kmalloc_heap, get_bin_of_ptr(&g_kmalloc_heap, ptr), ptr);
+	} else if (kind == KMALLOC_PAGE_LARGE) {
+		large_free(&g_kmalloc_heap, (kmalloc_header_t *)ptr - 1);
+	} else if (kind == KMALLOC_PAGE_ALIGNED) {
+		k_assert((uint32_t)ptr % MEM_PAGE_SIZE == 0, "Invalid ptr");
+		free_pages(&g_kmalloc_heap, ptr, get_aligned_num_pages(&g_kmalloc_heap, ptr));
 	} else {
-		bin_free((kmalloc_bin_t *)header->bin, header);
+		k_assert(kind == KMALLOC_PAGE_BIG, "Invalid ptr");
+
+		kmalloc_header_t *header = (kmalloc_header_t *)ptr - 1;
+		k_assert(header->bin != NULL, "Invalid ptr");
+
+		big_free(&g_kmalloc_heap, (kmalloc_big_bin_t *)header->bin, header);
 	}
 }
 
+void *kmalloc_aligned(k_size_t size, k_size_t align) {
+	k_assert(align > 0 && (align & (align - 1)) == 0, "Alignment is not a power of two");
+
+	if (size <= 0 || size > KMALLOC_MAX_SIZE) {
+		return NULL;
+	}
+
+	if (align <= 16) {
+		return kmalloc(size);
+	}
+
+	// Small blocks are 16-byte aligned, pad them so that an aligned pointer fits
+	if (align < MEM_PAGE_SIZE && !is_big_size_class(size + align - 16)) {
+		void *block = kmalloc(size + align - 16);
+		if (!block) {
+			return NULL;
+		}
+
+		return (void *)k_align_forward((uint32_t)block, (uint32_t)align);
+	}
+
+	return aligned_pages_alloc(&g_kmalloc_heap, size, k_max(align, MEM_PAGE_SIZE));
+}
+
+void *kcalloc(k_size_t count, k_size_t size) {
+	if (count <= 0 || size <= 0 || count > KMALLOC_MAX_SIZE / size) {
+		return NULL;
+	}
+
+	// kbrk does not zero the frames it claims, and freed blocks are reused as they are
+	void *ptr = kmalloc(count * size);
+	if (ptr) {
+		k_memset(ptr, 0, count * size);
+	}
+
+	return ptr;
+}
+
+void *krealloc(void *ptr, k_size_t size) {
+	if (!ptr) {
+		return kmalloc(size);
+	}
+
+	if (size <= 0) {
+		kfree(ptr);
+		return NULL;
+	}
+
+	// The block may already be big enough, since sizes are rounded up to their class
+	k_size_t old_size = ksize(ptr);
+	if (size <= old_size) {
+		return ptr;
+	}
+
+	if (size > KMALLOC_MAX_SIZE) {
+		return NULL;
+	}
+
+	if (*get_page_kind(&g_kmalloc_heap, ptr) == KMALLOC_PAGE_LARGE) {
+		if (large_grow(&g_kmalloc_heap, (kmalloc_header_t *)ptr - 1, size)) {
+			return ptr;
+		}
+	}
+
+	void *new_ptr = kmalloc(size);
+	if (!new_ptr) {
+		return NULL;
+	}
+
+	k_memcpy(new_ptr, ptr, old_size);
+	kfree(ptr);
+
+	return new_ptr;
+}
+
+void *kmalloc_pages(uint32_t num_pages) {
+	if (num_pages == 0) {
+		return NULL;
+	}
+
+	return alloc_pages(&g_kmalloc_heap, num_pages);
+}
+
+void kfree_pages(void *ptr, uint32_t num_pages) {
+	if (!ptr) {
+		return;
+	}
+
+	k_assert((uint32_t)ptr % MEM_PAGE_SIZE == 0, "Invalid ptr");
+	k_assert(*get_page_kind(&g_kmalloc_heap, ptr) == KMALLOC_PAGE_NONE, "Invalid ptr");
+
+	free_pages(&g_kmalloc_heap, ptr, num_pages);
+}
+
 k_size_t ksize(void *ptr) {
+	if (!ptr) {
+		return 0;
+	}
+
+	uint8_t kind = *get_page_kind(&g_kmalloc_heap, ptr);
+	if (kind >= KMALLOC_PAGE_BIN) {
+		kmalloc_bin_t *bin = get_bin_of_ptr(&g_kmalloc_heap, ptr);
+		return bin->alloc_size - ((uint8_t *)ptr - (uint8_t *)get_block_of_ptr(bin, ptr));
+	}
+
+	if (kind == KMALLOC_PAGE_ALIGNED) {
+		return get_aligned_num_pages(&g_kmalloc_heap, ptr) * MEM_PAGE_SIZE;
+	}
+
 	kmalloc_header_t *header = (kmalloc_header_t *)ptr - 1;
 
 	return header->size;
 }
 
+void *kvmalloc(k_size_t size) {
+	if (size <= 0) {
+		return NULL;
+	}
+
+	// The linear mapping is small, keep it for allocations that are worth it
+	if (size <= KVMALLOC_MAX_KMALLOC_SIZE) {
+		void *ptr = kmalloc(size);
+		if (ptr) {
+			return ptr;
+		}
+	}
+
+	return vmalloc(size);
+}
+
+static
+bool is_kmalloc_ptr(void *ptr) {
+	return (uint32_t)ptr >= KERNEL_VIRT_LINEAR_MAPPING_START && (uint32_t)ptr < KERNEL_VIRT_LINEAR_MAPPING_END;
+}
+
+void kvfree(void *ptr) {
+	if (!ptr) {
+		return;
+	}
+
+	if (is_kmalloc_ptr(ptr)) {
+		kfree(ptr);
+	} else {
+		vfree(ptr);
+	}
+}
+
+// Whole pages without header, so a run of n pages really takes n pages
+void *kvmalloc_pages(uint32_t num_pages) {
+	if (num_pages == 0 || num_pages > INT32_MAX / MEM_PAGE_SIZE) {
+		return NULL;
+	}
+
+	if (num_pages * MEM_PAGE_SIZE <= KVMALLOC_MAX_KMALLOC_SIZE) {
+		void *ptr = kmalloc_pages(num_pages);
+		if (ptr) {
+			return ptr;
+		}
+	}
+
+	return vmalloc_aligned(num_pages * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+}
+
+void kvfree_pages(void *ptr, uint32_t num_pages) {
+	if (!ptr) {
+		return;
+	}
+
+	if (is_kmalloc_ptr(ptr)) {
+		kfree_pages(ptr, num_pages);
+	} else {
+		vfree(ptr);
+	}
+}
+
+// Big requests use vmalloc_lazy, whose pages are zeroed when they are first accessed
+void *kvcalloc(k_size_t count, k_size_t size) {
+	if (count <= 0 || size <= 0 || count > INT32_MAX / size) {
+		return NULL;
+	}
+
+	if (count * size <= KVMALLOC_MAX_KMALLOC_SIZE) {
+		void *ptr = kcalloc(count, size);
+		if (ptr) {
+			return ptr;
+		}
+	}
+
+	return vmalloc_lazy(count * size);
+}
+
+k_size_t kvsize(void *ptr) {
+	if (!ptr) {
+		return 0;
+	}
+
+	if (is_kmalloc_ptr(ptr)) {
+		return ksize(ptr);
+	}
+
+	return vsize(ptr);
+}
+
 void kmalloc_print_info(void) {
 	k_printf("Kmalloc heap info:\n");
 
 	for (int i = 0; i < (int)NUM_KMALLOC_SIZE_CLASSES; i += 1) {
-		k_printf("Bins %d, size %n:\n", i, g_kmalloc_size_classes[i]);
+		k_printf("Bins %d, size %n, %d page(s) per bin:\n", i, g_kmalloc_size_classes[i], g_kmalloc_bin_num_pages[i]);
 		int bin_idx = 0;
 		int total_num_free_slots = 0;
 		int total_num_occupied_slots = 0;
-		for (kmalloc_bin_t *bin = g_kmalloc_heap.bin_list[i]; bin; bin = bin->next) {
-			int num_free_slots = 0;
-			for (kmalloc_header_t *alloc = bin->free_list; alloc; alloc = alloc->next) {
-				num_free_slots += 1;
-			}
+		int num_bins[KMALLOC_NUM_BIN_STATES] = {0};
+		for (int state = 0; state < KMALLOC_NUM_BIN_STATES; state += 1) {
+			for (kmalloc_bin_t *bin = g_kmalloc_heap.bin_lists[i][state]; bin; bin = bin->next) {
+				int num_free_slots = bin->num_slots - bin->num_used_slots;
+				int num_occupied_slots = bin->num_used_slots;
 
-			int num_occupied_slots = 0;
-			for (kmalloc_header_t *alloc = bin->occupied_list; alloc; alloc = alloc->next) {
-				num_occupied_slots += 1;
-			}
+				k_printf("  [%d]: %d free slot(s), %d occupied slot(s)\n", bin_idx, num_free_slots, num_occupied_slots);
 
-			k_printf("  [%d]: %d free slot(s), %d occupied slot(s)\n", bin_idx, num_free_slots, num_occupied_slots);
+				total_num_free_slots += num_free_slots;
+				total_num_occupied_slots += num_occupied_slots;
+				num_bins[state] += 1;
 
-			total_num_free_slots += num_free_slots;
-			total_num_occupied_slots += num_occupied_slots;
-
-			bin_idx += 1;
+				bin_idx += 1;
+			}
 		}
 
 		k_printf("  %d total free slot(s), %d occupied\n", total_num_free_slots, total_num_occupied_slots);
+		k_printf("  %d empty bin(s), %d partial, %d full\n", num_bins[KMALLOC_BIN_EMPTY], num_bins[KMALLOC_BIN_PARTIAL], num_bins[KMALLOC_BIN_FULL]);
 	}
 
 	for (int i = 0; i < (int)NUM_KMALLOC_BIG_SIZE_CLASSES; i += 1) {
@@ -401,4 +1058,18 @@ void kmalloc_print_info(void) {
 		k_printf("Big bin %d, size %n: %d free slot(s), %d occupied slot(s)\n", i, g_kmalloc_big_size_classes[i], num_free_slots, num_occupied_slots);
 	}
 
+	int num_large_allocs = 0;
+	for (kmalloc_header_t *alloc = g_kmalloc_heap.large_list; alloc; alloc = alloc->next) {
+		num_large_allocs += 1;
+	}
+
+	k_printf("Large allocations: %d, %n in total\n", num_large_allocs, g_kmalloc_heap.num_large_pages * MEM_PAGE_SIZE);
+
+	int num_runs = 0;
+	for (kmalloc_page_run_t *run = g_kmalloc_heap.free_page_runs; run; run = run->next) {
+		num_runs += 1;
+	}
+
+	k_printf("Page pool: %n in %d run(s), %n reclaimed in total\n", g_kmalloc_heap.num_free_pages * MEM_PAGE_SIZE, num_runs, g_kmalloc_heap.num_reclaimed_bytes);
+	k_printf("Heap top: %p, %n left before growing\n", g_kmalloc_heap.curr_addr, g_kmalloc_heap.end_addr - g_kmalloc_heap.curr_addr);
 }
@@ -0,0 +1,280 @@
+#include "alloc.h"
+
+// Object caches, for kernel objects that are allocated and freed often
+//
+// A cache hands out objects of a single size from slabs: a slab is a page taken from
+// the kmalloc heap (or from the page source of the cache), with the slab header at its top and as many objects as possible
+// after it. Like small kmalloc bins, a slab is found by rounding an object pointer down
+// to its page, and its free objects are linked through their own storage.
+//
+// When the cache has a constructor, objects are constructed once when their slab is
+// created, and must be freed in their constructed state so they can be handed out again
+// as is. The free list link is then stored after the object instead of inside it.
+
+#define KMEM_CACHE_MAX_EMPTY_SLABS 1 // The pages of other empty slabs go back to the kmalloc heap
+#define KMEM_CACHE_MIN_OBJECTS_PER_SLAB 8
+
+typedef struct kmem_slab_t {
+	struct kmem_slab_t *prev;
+	struct kmem_slab_t *next;
+	kmem_cache_t *cache;
+	void *free_list;
+	uint32_t num_used_objects;
+} kmem_slab_t;
+
+typedef enum kmem_slab_state_t {
+	KMEM_SLAB_EMPTY,
+	KMEM_SLAB_PARTIAL,
+	KMEM_SLAB_FULL,
+	KMEM_NUM_SLAB_STATES,
+} kmem_slab_state_t;
+
+struct kmem_cache_t {
+	struct kmem_cache_t *next;
+	const char *name;
+	k_size_t object_size;
+	k_size_t stride; // Object size with the free list link (if stored outside) and padding for alignment
+	k_size_t first_object_offset;
+	uint32_t num_objects_per_slab;
+	void (*ctor)(void *);
+	void *(*page_alloc)(void);
+	void (*page_free)(void *page);
+
+	kmem_slab_t *slab_lists[KMEM_NUM_SLAB_STATES];
+	uint32_t num_slabs[KMEM_NUM_SLAB_STATES];
+
+	uint32_t num_allocs;
+	uint32_t num_frees;
+};
+
+static kmem_cache_t *g_kmem_caches;
+
+static
+void *default_page_alloc(void) {
+	return kmalloc_pages(1);
+}
+
+static
+void default_page_free(void *page) {
+	kfree_pages(page, 1);
+}
+
+static
+void **get_free_link(kmem_cache_t *cache, void *object) {
+	if (cache->ctor) {
+		return (void **)((uint8_t *)object + cache->object_size);
+	}
+
+	return (void **)object;
+}
+
+static
+kmem_slab_t *get_slab_of_object(void *object) {
+	return (kmem_slab_t *)((uint32_t)object & ~(uint32_t)(MEM_PAGE_SIZE - 1));
+}
+
+static
+kmem_slab_state_t get_slab_state(kmem_slab_t *slab) {
+	if (slab->num_used_objects == 0) {
+		return KMEM_SLAB_EMPTY;
+	}
+
+	if (slab->num_used_objects == slab->cache->num_objects_per_slab) {
+		return KMEM_SLAB_FULL;
+	}
+
+	return KMEM_SLAB_PARTIAL;
+}
+
+static
+void slab_push_front(kmem_slab_t *slab) {
+	kmem_cache_t *cache = slab->cache;
+	kmem_slab_state_t state = get_slab_state(slab);
+	kmem_slab_t **first = &cache->slab_lists[state];
+	cache->num_slabs[state] += 1;
+
+	slab->prev = NULL;
+	slab->next = *first;
+	if (slab->next) {
+		slab->next->prev = slab;
+	}
+	*first = slab;
+}
+
+static
+void slab_pop(kmem_slab_t *slab, kmem_slab_state_t state) {
+	kmem_cache_t *cache = slab->cache;
+	kmem_slab_t **first = &cache->slab_lists[state];
+	cache->num_slabs[state] -= 1;
+
+	if (*first == slab) {
+		*first = slab->next;
+	}
+
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	}
+
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
+static
+kmem_slab_t *create_slab(kmem_cache_t *cache) {
+	kmem_slab_t *slab = cache->page_alloc();
+	if (!slab) {
+		return NULL;
+	}
+
+	k_memset(slab, 0, sizeof(*slab));
+	slab->cache = cache;
+
+	// Link the free objects in address order
+	uint8_t *objects = (uint8_t *)slab + cache->first_object_offset;
+	for (uint32_t i = cache->num_objects_per_slab; i > 0; i -= 1) {
+		void *object = objects + (i - 1) * cache->stride;
+		if (cache->ctor) {
+			cache->ctor(object);
+		}
+
+		*get_free_link(cache, object) = slab->free_list;
+		slab->free_list = object;
+	}
+
+	slab_push_front(slab);
+
+	return slab;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, k_size_t size, k_size_t align, void (*ctor)(void *)) {
+	return kmem_cache_create_with_page_source(name, size, align, ctor, default_page_alloc, default_page_free);
+}
+
+kmem_cache_t *kmem_cache_create_with_page_source(const char *name, k_size_t size, k_size_t align, void (*ctor)(void *), void *(*page_alloc)(void), void (*page_free)(void *)) {
+	k_assert(page_alloc != NULL && page_free != NULL, "Cache needs page allocation functions");
+
+	if (align <= 0) {
+		align = sizeof(void *);
+	}
+
+	k_assert(size > 0, "Invalid object size");
+	k_assert((align & (align - 1)) == 0, "Alignment is not a power of two");
+
+	kmem_cache_t *cache = kmalloc(sizeof(kmem_cache_t));
+	if (!cache) {
+		return NULL;
+	}
+
+	k_memset(cache, 0, sizeof(*cache));
+	cache->name = name;
+	cache->object_size = size;
+	cache->ctor = ctor;
+	cache->page_alloc = page_alloc;
+	cache->page_free = page_free;
+
+	k_size_t stride = k_max(size, (k_size_t)sizeof(void *));
+	if (ctor) {
+		stride = size + (k_size_t)sizeof(void *);
+	}
+	cache->stride = k_align_forward(stride, align);
+	cache->first_object_offset = k_align_forward((k_size_t)sizeof(kmem_slab_t), align);
+
+	k_assert(cache->first_object_offset + KMEM_CACHE_MIN_OBJECTS_PER_SLAB * cache->stride <= MEM_PAGE_SIZE, "Object size is too big for a cache, use kmalloc");
+	cache->num_objects_per_slab = (MEM_PAGE_SIZE - cache->first_object_offset) / cache->stride;
+
+	cache->next = g_kmem_caches;
+	g_kmem_caches = cache;
+
+	return cache;
+}
+
+// Create slabs until num_objects objects can be allocated without creating one
+bool kmem_cache_reserve(kmem_cache_t *cache, uint32_t num_objects) {
+	uint32_t num_slabs = cache->num_slabs[KMEM_SLAB_EMPTY] + cache->num_slabs[KMEM_SLAB_PARTIAL] + cache->num_slabs[KMEM_SLAB_FULL];
+	uint32_t num_free_objects = num_slabs * cache->num_objects_per_slab - (cache->num_allocs - cache->num_frees);
+
+	while (num_free_objects < num_objects) {
+		if (!create_slab(cache)) {
+			return false;
+		}
+
+		num_free_objects += cache->num_objects_per_slab;
+	}
+
+	return true;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+	kmem_slab_t *slab = cache->slab_lists[KMEM_SLAB_PARTIAL];
+	if (!slab) {
+		slab = cache->slab_lists[KMEM_SLAB_EMPTY];
+	}
+	if (!slab) {
+		slab = create_slab(cache);
+		if (!slab) {
+			return NULL;
+		}
+	}
+
+	kmem_slab_state_t prev_state = get_slab_state(slab);
+
+	void *object = slab->free_list;
+	slab->free_list = *get_free_link(cache, object);
+	slab->num_used_objects += 1;
+
+	if (get_slab_state(slab) != prev_state) {
+		slab_pop(slab, prev_state);
+		slab_push_front(slab);
+	}
+
+	cache->num_allocs += 1;
+
+	return object;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *object) {
+	if (!object) {
+		return;
+	}
+
+	kmem_slab_t *slab = get_slab_of_object(object);
+	k_assert(slab->cache == cache, "Object does not belong to this cache");
+	k_assert(((uint32_t)object - (uint32_t)slab - cache->first_object_offset) % cache->stride == 0, "Invalid object");
+	k_assert(slab->num_used_objects > 0, "Double free");
+
+	kmem_slab_state_t prev_state = get_slab_state(slab);
+
+	*get_free_link(cache, object) = slab->free_list;
+	slab->free_list = object;
+	slab->num_used_objects -= 1;
+
+	if (get_slab_state(slab) != prev_state) {
+		slab_pop(slab, prev_state);
+		slab_push_front(slab);
+	}
+
+	cache->num_frees += 1;
+
+	// Release the slab if the cache already has enough empty ones
+	if (slab->num_used_objects == 0 && cache->num_slabs[KMEM_SLAB_EMPTY] > KMEM_CACHE_MAX_EMPTY_SLABS) {
+		slab_pop(slab, KMEM_SLAB_EMPTY);
+		cache->page_free(slab);
+	}
+}
+
+void kmem_cache_print_info(void) {
+	k_printf("Object caches:\n");
+
+	for (kmem_cache_t *cache = g_kmem_caches; cache; cache = cache->next) {
+		uint32_t num_slabs = cache->num_slabs[KMEM_SLAB_EMPTY] + cache->num_slabs[KMEM_SLAB_PARTIAL] + cache->num_slabs[KMEM_SLAB_FULL];
+		uint32_t num_active_objects = cache->num_allocs - cache->num_frees;
+
+		k_printf("  %s: object size %n (stride %n), %u object(s) per slab\n", cache->name, cache->object_size, cache->stride, cache->num_objects_per_slab);
+		k_printf("    %u active object(s) out of %u, %u slab(s) (%u empty, %u partial, %u full)\n", num_active_objects, num_slabs * cache->num_objects_per_slab, num_slabs, cache->num_slabs[KMEM_SLAB_EMPTY], cache->num_slabs[KMEM_SLAB_PARTIAL], cache->num_slabs[KMEM_SLAB_FULL]);
+		k_printf("    %u alloc(s), %u free(s)\n", cache->num_allocs, cache->num_frees);
+	}
+}
@@ -38,6 +38,9 @@ typedef uint8_t k_byte_t;
 
 #define k_align_forward(x, align) ((((x) + (align) - 1) / (align)) * (align))
 
+#define k_min(a, b) ((a) < (b) ? (a) : (b))
+#define k_max(a, b) ((a) > (b) ? (a) : (b))
+
 // Assertions and debugging
 #define K_STATIC_ASSERT3(expr, line) typedef char static_assert_##line[(expr) ? 1 : -1]
 #define K_STATIC_ASSERT2(expr, line) K_STATIC_ASSERT3(expr, line)
@@ -62,6 +65,36 @@ void *k_memset(void *dst, k_byte_t value, k_size_t length);
 void *k_memcpy(void *dst, const void *src, k_size_t length);
 int k_memcmp(const void *a, const void *b, k_size_t length);
 
+// Bump allocator, everything allocated after a mark is freed at once by resetting to it
+// Chunks come from the functions given to k_arena_init, allocations are 16-byte aligned
+#define K_SCRATCH_ARENA_CHUNK_SIZE (16 * 1024)
+
+typedef struct k_arena_t {
+	struct k_arena_chunk_t *current;
+	void *(*chunk_alloc)(uint32_t num_pages);
+	void (*chunk_free)(void *ptr, uint32_t num_pages);
+	k_size_t min_chunk_size;
+	k_size_t num_used_bytes;
+	k_size_t peak_used_bytes;
+	k_size_t num_reserved_bytes;
+} k_arena_t;
+
+typedef struct k_arena_mark_t {
+	struct k_arena_chunk_t *chunk;
+	k_size_t used;
+} k_arena_mark_t;
+
+// Chunks are runs of whole pages, their header takes the start of the first page
+void k_arena_init(k_arena_t *arena, k_size_t min_chunk_size, void *(*chunk_alloc)(uint32_t), void (*chunk_free)(void *, uint32_t));
+void *k_arena_alloc(k_arena_t *arena, k_size_t size);
+k_arena_mark_t k_arena_mark(k_arena_t *arena);
+void k_arena_reset_to(k_arena_t *arena, k_arena_mark_t mark);
+void k_arena_release(k_arena_t *arena);
+void k_arena_print_info(k_arena_t *arena, const char *name);
+
+// For temporary allocations, the kernel initializes it once its heap is up and the shell resets it after each command
+k_arena_t *k_get_scratch_arena(void);
+
 k_size_t k_strlen(const char *str);
 char *k_strcpy(char *dst, const char *src);
 int k_strcmp(const char *a, const char *b);
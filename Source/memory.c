@@ -2,6 +2,9 @@
 
 #define NUM_BLOCKS_PER_ENTRY (sizeof(uint32_t) * 8)
 
+// Print every physical allocation and free, too noisy for the runs and batches of vmalloc
+#define MEM_DEBUG_LOG_PHYSICAL_BLOCKS 0
+
 // Set by the linker.ld script
 extern uint8_t kernel_start;
 extern uint8_t kernel_end;
@@ -39,10 +42,24 @@ static uint32_t g_num_used_physical_blocks;
 static uint32_t g_num_physical_blocks;
 static uint32_t *g_physical_memory_map; // Bit array, maps 4 GiB of memory
 static uint32_t g_physical_memory_map_num_elements;
+
+// Summary bitmaps on top of the physical memory map, to find free blocks without testing
+// every bit. A bit of the first level is set if the corresponding entry of the memory map
+// has at least one free block, a bit of the second level is set if the corresponding
+// entry of the first level has at least one bit set. For 4 GiB of memory this is 1024
+// and 32 entries, so searches only scan the 32 entries of the last level linearly.
+#define NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS 2
+
+static uint32_t *g_physical_memory_map_summaries[NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS];
+static uint32_t g_physical_memory_map_summary_num_elements[NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS];
+static uint32_t g_kernel_reserved_end_addr;
+static uint32_t g_kernel_brk_phys_start;
 static void *g_kernel_brk;
 
 static bool g_paging_enabled;
-static mem_page_dir_table_t *g_current_page_dir_table;
+static mem_page_dir_table_t *g_current_page_dir_table; // Physical address
+static uint32_t g_fixed_mapping_page_table; // Physical address
+static mem_page_dir_table_t *g_kernel_dir_table; // Physical address
 
 uint32_t mem_get_used_physical_blocks() {
     return g_num_used_physical_blocks;
@@ -68,6 +85,138 @@ uint32_t get_physical_block_addr(uint32_t block_index) {
     return block_index * MEM_PAGE_SIZE;
 }
 
+static
+void mark_physical_memory_map_entry_as_full(uint32_t entry_index) {
+	for (int level = 0; level < NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS; level += 1) {
+		uint32_t *summary = g_physical_memory_map_summaries[level];
+		summary[entry_index / NUM_BLOCKS_PER_ENTRY] &= ~(1u << (entry_index % NUM_BLOCKS_PER_ENTRY));
+
+		entry_index /= NUM_BLOCKS_PER_ENTRY;
+		if (summary[entry_index] != 0) {
+			break;
+		}
+	}
+}
+
+static
+void mark_physical_memory_map_entry_as_not_full(uint32_t entry_index) {
+	for (int level = 0; level < NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS; level += 1) {
+		uint32_t *summary = g_physical_memory_map_summaries[level];
+		uint32_t prev = summary[entry_index / NUM_BLOCKS_PER_ENTRY];
+		summary[entry_index / NUM_BLOCKS_PER_ENTRY] |= 1u << (entry_index % NUM_BLOCKS_PER_ENTRY);
+
+		entry_index /= NUM_BLOCKS_PER_ENTRY;
+		if (prev != 0) {
+			break;
+		}
+	}
+}
+
+static
+void init_physical_memory_map_summaries(void) {
+	for (int level = 0; level < NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS; level += 1) {
+		k_memset(g_physical_memory_map_summaries[level], 0, g_physical_memory_map_summary_num_elements[level] * sizeof(uint32_t));
+	}
+
+	for (uint32_t i = 0; i < g_physical_memory_map_num_elements; i += 1) {
+		if (g_physical_memory_map[i] != 0xffffffff) {
+			mark_physical_memory_map_entry_as_not_full(i);
+		}
+	}
+}
+
+// Get the entry of the given level, level 0 is the memory map with free blocks as set bits
+static
+uint32_t get_physical_memory_map_level_entry(int level, uint32_t entry_index) {
+	if (level == 0) {
+		return ~g_physical_memory_map[entry_index];
+	}
+
+	return g_physical_memory_map_summaries[level - 1][entry_index];
+}
+
+static
+uint32_t get_physical_memory_map_level_num_elements(int level) {
+	if (level == 0) {
+		return g_physical_memory_map_num_elements;
+	}
+
+	return g_physical_memory_map_summary_num_elements[level - 1];
+}
+
+// Find the first set bit >= bit_index in the given level
+static
+bool find_next_set_bit_in_physical_memory_map_level(int level, uint32_t bit_index, uint32_t *out_bit_index) {
+	uint32_t num_elements = get_physical_memory_map_level_num_elements(level);
+	uint32_t entry_index = bit_index / NUM_BLOCKS_PER_ENTRY;
+	if (entry_index >= num_elements) {
+		return false;
+	}
+
+	uint32_t bits = get_physical_memory_map_level_entry(level, entry_index) & (0xffffffff << (bit_index % NUM_BLOCKS_PER_ENTRY));
+	if (!bits) {
+		entry_index += 1;
+
+		if (level == NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS) {
+			while (entry_index < num_elements && !get_physical_memory_map_level_entry(level, entry_index)) {
+				entry_index += 1;
+			}
+
+			if (entry_index >= num_elements) {
+				return false;
+			}
+		} else if (!find_next_set_bit_in_physical_memory_map_level(level + 1, entry_index, &entry_index)) {
+			return false;
+		}
+
+		bits = get_physical_memory_map_level_entry(level, entry_index);
+		k_assert(bits != 0, "Physical memory map summary is out of date");
+	}
+
+	*out_bit_index = entry_index * NUM_BLOCKS_PER_ENTRY + __builtin_ctz(bits);
+
+	return true;
+}
+
+// Find the last set bit < bit_index in the given level
+static
+bool find_prev_set_bit_in_physical_memory_map_level(int level, uint32_t bit_index, uint32_t *out_bit_index) {
+	if (bit_index == 0) {
+		return false;
+	}
+
+	bit_index -= 1;
+
+	uint32_t entry_index = bit_index / NUM_BLOCKS_PER_ENTRY;
+	uint32_t num_elements = get_physical_memory_map_level_num_elements(level);
+	if (entry_index >= num_elements) {
+		entry_index = num_elements - 1;
+		bit_index = num_elements * NUM_BLOCKS_PER_ENTRY - 1;
+	}
+
+	uint32_t bits = get_physical_memory_map_level_entry(level, entry_index) & (0xffffffff >> (31 - bit_index % NUM_BLOCKS_PER_ENTRY));
+	if (!bits) {
+		if (level == NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS) {
+			do {
+				if (entry_index == 0) {
+					return false;
+				}
+
+				entry_index -= 1;
+			} while (!get_physical_memory_map_level_entry(level, entry_index));
+		} else if (!find_prev_set_bit_in_physical_memory_map_level(level + 1, entry_index, &entry_index)) {
+			return false;
+		}
+
+		bits = get_physical_memory_map_level_entry(level, entry_index);
+		k_assert(bits != 0, "Physical memory map summary is out of date");
+	}
+
+	*out_bit_index = entry_index * NUM_BLOCKS_PER_ENTRY + 31 - __builtin_clz(bits);
+
+	return true;
+}
+
 static
 bool is_physical_block_free(uint32_t block_index) {
     k_assert(block_index < g_num_physical_blocks, "Invalid block index");
@@ -78,6 +227,7 @@ bool is_physical_block_free(uint32_t block_index) {
     return (g_physical_memory_map[entry_index] & (1 << bit_index)) == 0;
 }
 
+static
 void mark_physical_block_as_used(uint32_t block_index) {
     k_assert(block_index < g_num_physical_blocks, "Invalid block index");
 
@@ -89,6 +239,10 @@ void mark_physical_block_as_used(uint32_t block_index) {
     uint32_t bit_index = block_index % NUM_BLOCKS_PER_ENTRY;
 
     g_physical_memory_map[entry_index] |= (1 << bit_index);
+
+    if (g_physical_memory_map[entry_index] == 0xffffffff) {
+        mark_physical_memory_map_entry_as_full(entry_index);
+    }
 }
 
 static
@@ -104,6 +258,8 @@ void mark_physical_block_as_free(uint32_t block_index) {
     uint32_t bit_index = block_index % NUM_BLOCKS_PER_ENTRY;
 
     g_physical_memory_map[entry_index] &= ~(1 << bit_index);
+
+    mark_physical_memory_map_entry_as_not_full(entry_index);
 }
 
 static
@@ -136,60 +292,400 @@ void mark_physical_region_as_free(uint32_t start_addr, uint32_t end_addr) {
 
 uint32_t get_first_free_physical_block_from(uint32_t start_index)
 {
-	for (uint32_t i = start_index; i < g_num_physical_blocks; i += 1) {
-		if (is_physical_block_free(i)) {
-			return i;
-		}
+	uint32_t block_index;
+	if (find_next_set_bit_in_physical_memory_map_level(0, start_index, &block_index)) {
+		return block_index;
 	}
 
 	return 0; // Block 0 is reserved, so it's fine that we return it when no block is free
 }
 
 static
-uint32_t get_first_free_physical_blocks(int32_t num_blocks, uint32_t start_block_index, bool reverse_search) {
-	if (num_blocks <= 0) {
+uint32_t get_last_free_physical_block_before(uint32_t end_index)
+{
+	uint32_t block_index;
+	if (find_prev_set_bit_in_physical_memory_map_level(0, end_index, &block_index)) {
+		return block_index;
+	}
+
+	return 0;
+}
+
+// Physical memory is split into zones (see mem_zone_t), each zone has its own binary
+// buddy allocator and free block count.
+// Physical blocks are allocated with binary buddy allocators: free memory is kept as
+// naturally aligned, power of two sized runs of blocks, with one free list per order.
+// Allocating splits a run until it has the requested order, freeing merges a run with
+// its buddy for as long as the buddy is free too, so both are O(log n).
+// Most of physical memory is not mapped, so the free list links and the order of free
+// runs cannot be stored inside the free blocks themselves. They live in arrays that
+// are placed right after the physical memory map instead.
+// The physical memory map is still kept up to date, it is used to cross check the
+// buddy allocators (see mem_print_physical_memory_map).
+
+#define MEM_BUDDY_MAX_ORDER 20 // 4 GiB worth of blocks
+#define MEM_BUDDY_NUM_ORDERS (MEM_BUDDY_MAX_ORDER + 1)
+
+// What a block is used for decides which member is valid
+typedef struct mem_physical_block_info_t {
+	union {
+		struct { // Start of a free run
+			uint32_t prev_free;
+			uint32_t next_free;
+		};
+		struct { // Reclaimable page table
+			uint32_t num_live_entries; // Present or demand-zero entries
+		} page_table;
+	};
+} mem_physical_block_info_t;
+
+typedef struct mem_buddy_allocator_t {
+	const char *name;
+	uint32_t min_block;
+	uint32_t max_block; // One past the last block
+	uint32_t num_free_blocks;
+	bool top_down; // Hand out the upper half when splitting runs, to keep the bottom free for as long as possible
+	uint32_t free_lists[MEM_BUDDY_NUM_ORDERS]; // Block 0 is never free, so we use it as the end of list marker
+} mem_buddy_allocator_t;
+
+static mem_physical_block_info_t *g_physical_block_infos;
+static uint8_t *g_physical_block_orders; // Order + 1 for blocks that start a free run, 0 otherwise
+static mem_buddy_allocator_t g_zone_allocators[MEM_NUM_ZONES];
+
+static
+uint32_t get_buddy_order(uint32_t num_blocks) {
+	uint32_t order = 0;
+	while (order <= MEM_BUDDY_MAX_ORDER && (1u << order) < num_blocks) {
+		order += 1;
+	}
+
+	return order;
+}
+
+static
+mem_buddy_allocator_t *get_zone_allocator_of_block(uint32_t block_index) {
+	for (int i = 0; i < MEM_NUM_ZONES; i += 1) {
+		mem_buddy_allocator_t *buddy = &g_zone_allocators[i];
+		if (block_index >= buddy->min_block && block_index < buddy->max_block) {
+			return buddy;
+		}
+	}
+
+	return NULL;
+}
+
+static
+void buddy_push_free_run(mem_buddy_allocator_t *buddy, uint32_t block_index, uint32_t order) {
+	mem_physical_block_info_t *info = &g_physical_block_infos[block_index];
+	info->prev_free = 0;
+	info->next_free = buddy->free_lists[order];
+	if (info->next_free) {
+		g_physical_block_infos[info->next_free].prev_free = block_index;
+	}
+
+	buddy->free_lists[order] = block_index;
+	g_physical_block_orders[block_index] = order + 1;
+}
+
+static
+void buddy_remove_free_run(mem_buddy_allocator_t *buddy, uint32_t block_index, uint32_t order) {
+	mem_physical_block_info_t *info = &g_physical_block_infos[block_index];
+	if (info->prev_free) {
+		g_physical_block_infos[info->prev_free].next_free = info->next_free;
+	} else {
+		buddy->free_lists[order] = info->next_free;
+	}
+
+	if (info->next_free) {
+		g_physical_block_infos[info->next_free].prev_free = info->prev_free;
+	}
+
+	info->prev_free = 0;
+	info->next_free = 0;
+	g_physical_block_orders[block_index] = 0;
+}
+
+static
+bool buddy_is_free_run(mem_buddy_allocator_t *buddy, uint32_t block_index, uint32_t order) {
+	if (block_index < buddy->min_block || block_index + (1u << order) > buddy->max_block) {
+		return false;
+	}
+
+	return g_physical_block_orders[block_index] == order + 1;
+}
+
+static
+void buddy_free(mem_buddy_allocator_t *buddy, uint32_t block_index, uint32_t order) {
+	buddy->num_free_blocks += 1u << order;
+
+	while (order < MEM_BUDDY_MAX_ORDER) {
+		uint32_t buddy_index = buddy->min_block + ((block_index - buddy->min_block) ^ (1u << order));
+		if (!buddy_is_free_run(buddy, buddy_index, order)) {
+			break;
+		}
+
+		buddy_remove_free_run(buddy, buddy_index, order);
+		block_index = k_min(block_index, buddy_index);
+		order += 1;
+	}
+
+	buddy_push_free_run(buddy, block_index, order);
+}
+
+// Free a run of any size by splitting it into naturally aligned power of two runs
+static
+void buddy_free_blocks(mem_buddy_allocator_t *buddy, uint32_t block_index, uint32_t num_blocks) {
+	while (num_blocks > 0) {
+		uint32_t order = 0;
+		while (order < MEM_BUDDY_MAX_ORDER
+			&& ((block_index - buddy->min_block) & (1u << order)) == 0
+			&& (2u << order) <= num_blocks
+		) {
+			order += 1;
+		}
+
+		buddy_free(buddy, block_index, order);
+
+		block_index += 1u << order;
+		num_blocks -= 1u << order;
+	}
+}
+
+static
+uint32_t buddy_alloc(mem_buddy_allocator_t *buddy, uint32_t order) {
+	uint32_t run_order = order;
+	while (run_order <= MEM_BUDDY_MAX_ORDER && !buddy->free_lists[run_order]) {
+		run_order += 1;
+	}
+
+	if (run_order > MEM_BUDDY_MAX_ORDER) {
 		return 0;
 	}
 
-	if (g_num_used_physical_blocks >= g_num_physical_blocks) {
+	uint32_t block_index = buddy->free_lists[run_order];
+	buddy_remove_free_run(buddy, block_index, run_order);
+
+	while (run_order > order) {
+		run_order -= 1;
+
+		uint32_t half = 1u << run_order;
+		if (buddy->top_down) {
+			buddy_push_free_run(buddy, block_index, run_order);
+			block_index += half;
+		} else {
+			buddy_push_free_run(buddy, block_index + half, run_order);
+		}
+	}
+
+	buddy->num_free_blocks -= 1u << order;
+
+	return block_index;
+}
+
+// Allocate exactly num_blocks blocks, the blocks past num_blocks in the run are given back
+static
+uint32_t buddy_alloc_blocks(mem_buddy_allocator_t *buddy, uint32_t num_blocks) {
+	uint32_t order = get_buddy_order(num_blocks);
+	if (order > MEM_BUDDY_MAX_ORDER) {
 		return 0;
 	}
 
-	if (reverse_search) {
-		if (start_block_index < (uint32_t)num_blocks) {
-			return 0;
+	uint32_t block_index = buddy_alloc(buddy, order);
+	if (!block_index) {
+		return 0;
+	}
+
+	uint32_t excess = (1u << order) - num_blocks;
+	if (excess > 0) {
+		buddy_free_blocks(buddy, block_index + num_blocks, excess);
+	}
+
+	return block_index;
+}
+
+// Allocate max_blocks blocks if a free run is big enough, otherwise the biggest free run
+static
+uint32_t buddy_alloc_up_to(mem_buddy_allocator_t *buddy, uint32_t max_blocks, uint32_t *num_blocks) {
+	uint32_t order = get_buddy_order(max_blocks);
+	for (uint32_t o = order; o <= MEM_BUDDY_MAX_ORDER; o += 1) {
+		if (buddy->free_lists[o]) {
+			*num_blocks = max_blocks;
+			return buddy_alloc_blocks(buddy, max_blocks);
 		}
+	}
 
-		for (uint32_t i = start_block_index - (uint32_t)num_blocks; i > 0; i -= 1) {
-			bool all_free = true;
-			for (uint32_t j = 0; j < (uint32_t)num_blocks; j += 1) {
-				if (!is_physical_block_free(i + j)) {
-					all_free = false;
-					break;
-				}
+	for (uint32_t o = k_min(order, MEM_BUDDY_NUM_ORDERS); o > 0; o -= 1) {
+		if (buddy->free_lists[o - 1]) {
+			*num_blocks = 1u << (o - 1);
+			return buddy_alloc(buddy, o - 1);
+		}
+	}
+
+	return 0;
+}
+
+// Allocate a specific block, splitting the free run that contains it
+static
+bool buddy_claim(mem_buddy_allocator_t *buddy, uint32_t block_index) {
+	uint32_t order = 0;
+	uint32_t run_index = block_index;
+	while (true) {
+		run_index = buddy->min_block + ((block_index - buddy->min_block) & ~((1u << order) - 1));
+		if (buddy_is_free_run(buddy, run_index, order)) {
+			break;
+		}
+
+		order += 1;
+		if (order > MEM_BUDDY_MAX_ORDER) {
+			return false;
+		}
+	}
+
+	buddy_remove_free_run(buddy, run_index, order);
+
+	while (order > 0) {
+		order -= 1;
+
+		uint32_t half = 1u << order;
+		if (block_index >= run_index + half) {
+			buddy_push_free_run(buddy, run_index, order);
+			run_index += half;
+		} else {
+			buddy_push_free_run(buddy, run_index + half, order);
+		}
+	}
+
+	buddy->num_free_blocks -= 1;
+
+	return true;
+}
+
+static
+void init_zone_allocators(void) {
+	uint32_t kernel_brk_start_block = get_physical_block_index_of_addr(g_kernel_brk_phys_start);
+	kernel_brk_start_block = k_min(kernel_brk_start_block, g_num_physical_blocks);
+
+	uint32_t linear_mapping_end_block = get_physical_block_index_of_addr(KERNEL_VIRT_LINEAR_MAPPING_END - KERNEL_VIRT_START);
+	linear_mapping_end_block = k_min(linear_mapping_end_block, g_num_physical_blocks);
+
+	k_memset(g_zone_allocators, 0, sizeof(g_zone_allocators));
+
+	g_zone_allocators[MEM_ZONE_DMA].name = "DMA";
+	g_zone_allocators[MEM_ZONE_DMA].min_block = 0;
+	g_zone_allocators[MEM_ZONE_DMA].max_block = kernel_brk_start_block;
+
+	g_zone_allocators[MEM_ZONE_LINEAR].name = "Linear";
+	g_zone_allocators[MEM_ZONE_LINEAR].min_block = kernel_brk_start_block;
+	g_zone_allocators[MEM_ZONE_LINEAR].max_block = linear_mapping_end_block;
+	g_zone_allocators[MEM_ZONE_LINEAR].top_down = true; // Keep the bottom for kbrk to grow into
+
+	g_zone_allocators[MEM_ZONE_HIGH].name = "High";
+	g_zone_allocators[MEM_ZONE_HIGH].min_block = linear_mapping_end_block;
+	g_zone_allocators[MEM_ZONE_HIGH].max_block = g_num_physical_blocks;
+
+	k_memset(g_physical_block_orders, 0, g_num_physical_blocks);
+
+	// Give all the runs of free blocks of the memory map to the zone allocators
+	for (int i = 0; i < MEM_NUM_ZONES; i += 1) {
+		mem_buddy_allocator_t *buddy = &g_zone_allocators[i];
+
+		uint32_t block_index = buddy->min_block;
+		while (block_index < buddy->max_block) {
+			if (!is_physical_block_free(block_index)) {
+				block_index += 1;
+				continue;
 			}
 
-			if (all_free) {
-				return i;
+			uint32_t num_blocks = 0;
+			while (block_index + num_blocks < buddy->max_block && is_physical_block_free(block_index + num_blocks)) {
+				num_blocks += 1;
 			}
+
+			buddy_free_blocks(buddy, block_index, num_blocks);
+			block_index += num_blocks;
 		}
-	} else {
-		for (uint32_t i = start_block_index; i < g_num_physical_blocks; i += 1) {
-			bool all_free = true;
-			for (uint32_t j = 0; j < (uint32_t)num_blocks; j += 1) {
-				if (!is_physical_block_free(i + j)) {
-					all_free = false;
-					break;
+	}
+}
+
+static
+bool claim_physical_block(uint32_t block_index) {
+	if (!is_physical_block_free(block_index)) {
+		return false;
+	}
+
+	mem_buddy_allocator_t *buddy = get_zone_allocator_of_block(block_index);
+	k_assert(buddy != NULL, "Invalid block index");
+
+	bool claimed = buddy_claim(buddy, block_index);
+	k_assert(claimed, "Buddy allocator and physical memory map disagree");
+
+	mark_physical_block_as_used(block_index);
+
+	return true;
+}
+
+// Check that the zone allocators agree with the physical memory map
+static
+bool check_zone_allocators(void) {
+	bool ok = true;
+	uint32_t total_num_free_blocks = 0;
+
+	for (int i = 0; i < MEM_NUM_ZONES; i += 1) {
+		mem_buddy_allocator_t *buddy = &g_zone_allocators[i];
+
+		uint32_t num_free_blocks = 0;
+		for (uint32_t order = 0; order <= MEM_BUDDY_MAX_ORDER; order += 1) {
+			for (uint32_t run = buddy->free_lists[order]; run; run = g_physical_block_infos[run].next_free) {
+				for (uint32_t j = 0; j < (1u << order); j += 1) {
+					if (!is_physical_block_free(run + j)) {
+						k_printf("  %s zone: block %u is free, but marked as used in the memory map\n", buddy->name, run + j);
+						ok = false;
+					}
 				}
+
+				num_free_blocks += 1u << order;
+			}
+		}
+
+		if (num_free_blocks != buddy->num_free_blocks) {
+			k_printf("  %s zone: %u blocks in the free lists, expected %u\n", buddy->name, num_free_blocks, buddy->num_free_blocks);
+			ok = false;
+		}
+
+		total_num_free_blocks += num_free_blocks;
+	}
+
+	if (total_num_free_blocks != g_num_physical_blocks - g_num_used_physical_blocks) {
+		k_printf("  Zone allocators have %u free blocks, memory map has %u\n", total_num_free_blocks, g_num_physical_blocks - g_num_used_physical_blocks);
+		ok = false;
+	}
+
+	return ok;
+}
+
+static
+void print_zone_allocators(void) {
+	for (int i = 0; i < MEM_NUM_ZONES; i += 1) {
+		mem_buddy_allocator_t *buddy = &g_zone_allocators[i];
+
+		k_printf("%s zone (blocks %u-%u, %u free):\n", buddy->name, buddy->min_block, buddy->max_block, buddy->num_free_blocks);
+		for (uint32_t order = 0; order <= MEM_BUDDY_MAX_ORDER; order += 1) {
+			uint32_t num_runs = 0;
+			for (uint32_t run = buddy->free_lists[order]; run; run = g_physical_block_infos[run].next_free) {
+				num_runs += 1;
 			}
 
-			if (all_free) {
-				return i;
+			if (num_runs > 0) {
+				k_printf("  order %u (%n): %u free run(s)\n", order, (1u << order) * MEM_PAGE_SIZE, num_runs);
 			}
 		}
 	}
 
-	return 0; // Block 0 is reserved, so it's fine that we return it when no block is free
+	if (check_zone_allocators()) {
+		k_printf("Zone allocators agree with the memory map\n");
+	} else {
+		k_printf("\x1b[31mZone allocators disagree with the memory map\x1b[0m\n");
+	}
 }
 
 static void init_virtual_memory();
@@ -219,6 +715,22 @@ void mem_init_with_multiboot_info(const multiboot_info_t *info) {
 
 	g_physical_memory_map = (uint32_t *)k_align_forward(get_kernel_end_phys_addr(), 16);
 
+	// The summaries and the buddy allocator metadata are put right after the memory map
+	uint32_t *summary_end = g_physical_memory_map + g_physical_memory_map_num_elements;
+	uint32_t num_summarized_elements = g_physical_memory_map_num_elements;
+	for (int i = 0; i < NUM_PHYSICAL_MEMORY_MAP_SUMMARY_LEVELS; i += 1) {
+		num_summarized_elements = num_summarized_elements / NUM_BLOCKS_PER_ENTRY + ((num_summarized_elements % NUM_BLOCKS_PER_ENTRY) != 0);
+
+		g_physical_memory_map_summaries[i] = summary_end;
+		g_physical_memory_map_summary_num_elements[i] = num_summarized_elements;
+		summary_end += num_summarized_elements;
+	}
+
+	g_physical_block_infos = (mem_physical_block_info_t *)k_align_forward((uint32_t)summary_end, 16);
+	g_physical_block_orders = (uint8_t *)(g_physical_block_infos + g_num_physical_blocks);
+	g_kernel_reserved_end_addr = (uint32_t)(g_physical_block_orders + g_num_physical_blocks);
+	uint32_t reserved_size = g_kernel_reserved_end_addr - (uint32_t)g_physical_memory_map;
+
 	k_printf("Kernel loaded at %p - %p\n", get_kernel_start_phys_addr(), get_kernel_end_phys_addr());
 	k_printf("System memory: %n, %u blocks\n", g_system_memory, g_num_physical_blocks);
 	k_printf("Memory map addr: %p, %u entries\n", g_physical_memory_map, g_physical_memory_map_num_elements);
@@ -234,7 +746,7 @@ void mem_init_with_multiboot_info(const multiboot_info_t *info) {
 
 		if (map->addr_low <= (uint32_t)g_physical_memory_map && map->addr_low + map->len_low > (uint32_t)g_physical_memory_map) {
 			k_assert(map->type == MULTIBOOT_MEMORY_AVAILABLE, "Placed memory map in an unavailable memory region");
-			k_assert((uint32_t)g_physical_memory_map + memory_map_size <= map->addr_low + map->len_low, "Placed memory map in a memory region that is not big enough");
+			k_assert((uint32_t)g_physical_memory_map + reserved_size <= map->addr_low + map->len_low, "Placed memory map in a memory region that is not big enough");
 			break;
 		}
 	}
@@ -243,6 +755,13 @@ void mem_init_with_multiboot_info(const multiboot_info_t *info) {
 	g_num_used_physical_blocks = 0;
 	k_memset(g_physical_memory_map, 0, memory_map_size);
 
+	// The bits past the last block are never free
+	if (g_num_physical_blocks % NUM_BLOCKS_PER_ENTRY != 0) {
+		g_physical_memory_map[g_physical_memory_map_num_elements - 1] = 0xffffffff << (g_num_physical_blocks % NUM_BLOCKS_PER_ENTRY);
+	}
+
+	init_physical_memory_map_summaries();
+
 	// Iterate over the multiboot memory map to mark blocks as used in our memory map array based on their type
 	offset = 0;
 	while (offset < info->mmap_length) {
@@ -263,8 +782,12 @@ void mem_init_with_multiboot_info(const multiboot_info_t *info) {
 	}
 
 	// Mark memory for our kernel and our memory system as used
-	uint32_t kernel_reserved_end_addr = (uint32_t)g_physical_memory_map + memory_map_size;
-	mark_physical_region_as_used(0, kernel_reserved_end_addr - 1);
+	mark_physical_region_as_used(0, g_kernel_reserved_end_addr - 1);
+
+	// Kbrk starts at 4 MiB, unless the memory system's metadata goes past that
+	g_kernel_brk_phys_start = k_max(0x400000, k_align_forward(g_kernel_reserved_end_addr, MEM_PAGE_SIZE));
+
+	init_zone_allocators();
 
 	mem_print_physical_memory_map();
 
@@ -299,6 +822,8 @@ void mem_print_physical_memory_map(void) {
 	}
 
 	k_printf("End of memory map\n");
+
+	print_zone_allocators();
 }
 
 mem_page_table_entry_t *mem_get_page_table_entry(mem_page_table_t *table, virt_addr_t addr) {
@@ -315,46 +840,151 @@ mem_page_dir_entry_t *mem_get_page_dir_entry(mem_page_dir_table_t *table, virt_a
 	return NULL;
 }
 
-uint32_t mem_alloc_physical_blocks(int32_t num_blocks, uint32_t start_block_index, bool reverse_search) {
+uint32_t mem_get_free_physical_blocks_in_zone(mem_zone_t zone) {
+	k_assert(zone >= 0 && zone < MEM_NUM_ZONES, "Invalid zone");
+
+	return g_zone_allocators[zone].num_free_blocks;
+}
+
+static
+uint32_t zone_alloc_blocks(mem_buddy_allocator_t *buddy, uint32_t num_blocks) {
+	if (num_blocks > buddy->num_free_blocks) {
+		return 0;
+	}
+
+	if (num_blocks > 1) {
+		return buddy_alloc_blocks(buddy, num_blocks);
+	}
+
+	// Single blocks are found using the summarized memory map so they are always taken
+	// from the preferred end of the zone, then claimed from the zone's buddy allocator
+	uint32_t block_index;
+	if (buddy->top_down) {
+		block_index = get_last_free_physical_block_before(buddy->max_block);
+		if (block_index < buddy->min_block) {
+			block_index = 0;
+		}
+	} else {
+		block_index = get_first_free_physical_block_from(buddy->min_block);
+		if (block_index >= buddy->max_block) {
+			block_index = 0;
+		}
+	}
+
+	if (block_index) {
+		bool claimed = buddy_claim(buddy, block_index);
+		k_assert(claimed, "Buddy allocator and physical memory map disagree");
+	}
+
+	return block_index;
+}
+
+// Does not print anything, so it can be used from the page fault handler
+static
+uint32_t alloc_physical_blocks(int32_t num_blocks, mem_zone_t zone) {
+	k_assert(zone >= 0 && zone < MEM_NUM_ZONES, "Invalid zone");
+
 	if (num_blocks <= 0) {
 		return 0;
 	}
 
-	uint32_t block_index = get_first_free_physical_blocks(num_blocks, start_block_index, reverse_search);
+	// Fallback to the zones below when the requested zone is exhausted
+	uint32_t block_index = 0;
+	for (int z = zone; z >= 0 && !block_index; z -= 1) {
+		block_index = zone_alloc_blocks(&g_zone_allocators[z], (uint32_t)num_blocks);
+	}
+
 	if (!block_index) {
 		return 0;
 	}
 
 	for (uint32_t i = 0; i < (uint32_t)num_blocks; i += 1) {
+		k_assert(is_physical_block_free(block_index + i), "Buddy allocator and physical memory map disagree");
 		mark_physical_block_as_used(block_index + i);
 	}
 
-	uint32_t ptr = get_physical_block_addr(block_index);
-	k_printf("Allocated %d physical block(s): %p\n", num_blocks, ptr);
+	return get_physical_block_addr(block_index);
+}
+
+uint32_t mem_alloc_physical_blocks(int32_t num_blocks, mem_zone_t zone) {
+	uint32_t ptr = alloc_physical_blocks(num_blocks, zone);
+#if MEM_DEBUG_LOG_PHYSICAL_BLOCKS
+	if (ptr) {
+		k_printf("Allocated %d physical block(s): %p\n", num_blocks, ptr);
+	}
+#endif
 
 	return ptr;
 }
 
-void mem_free_physical_blocks(uint32_t block, int32_t num_blocks) {
+uint32_t mem_alloc_physical_runs(uint32_t num_blocks, mem_zone_t zone, mem_physical_run_t *runs, uint32_t max_runs, uint32_t *num_runs) {
+	k_assert(zone >= 0 && zone < MEM_NUM_ZONES, "Invalid zone");
+
+	uint32_t num_allocated = 0;
+	*num_runs = 0;
+
+	// Fallback to the zones below when the requested zone is exhausted
+	for (int z = zone; z >= 0; z -= 1) {
+		mem_buddy_allocator_t *buddy = &g_zone_allocators[z];
+
+		while (num_allocated < num_blocks && *num_runs < max_runs && buddy->num_free_blocks > 0) {
+			uint32_t count = 0;
+			uint32_t block_index = buddy_alloc_up_to(buddy, num_blocks - num_allocated, &count);
+			if (!block_index) {
+				break;
+			}
+
+			for (uint32_t i = 0; i < count; i += 1) {
+				k_assert(is_physical_block_free(block_index + i), "Buddy allocator and physical memory map disagree");
+				mark_physical_block_as_used(block_index + i);
+			}
+
+			runs[*num_runs].physical_addr = get_physical_block_addr(block_index);
+			runs[*num_runs].num_blocks = count;
+			*num_runs += 1;
+
+			num_allocated += count;
+		}
+	}
+
+	return num_allocated;
+}
+
+void mem_free_physical_blocks(uint32_t block, int32_t num_blocks) {
 	if (!block || num_blocks <= 0) {
 		return;
 	}
 
 	uint32_t block_index = get_physical_block_index_of_addr(block);
+#if MEM_DEBUG_LOG_PHYSICAL_BLOCKS
 	k_printf("Freeing %d block(s) at %p (index %u)\n", num_blocks, block, block_index);
+#endif
 	k_assert(get_physical_block_addr(block_index) == block, "Block does not point to the start of a physical block");
 
 	// @Todo: ensure we cannot mark reserved blocks as free
 	for (int32_t i = 0; i < num_blocks; i += 1) {
-		k_assert(!is_physical_block_free(block_index), "Double free");
+		k_assert(!is_physical_block_free(block_index + i), "Double free");
 		mark_physical_block_as_free(block_index + i);
 	}
+
+	// The blocks may span several zones
+	uint32_t remaining = (uint32_t)num_blocks;
+	while (remaining > 0) {
+		mem_buddy_allocator_t *buddy = get_zone_allocator_of_block(block_index);
+		k_assert(buddy != NULL, "Invalid block index");
+
+		uint32_t count = k_min(remaining, buddy->max_block - block_index);
+		buddy_free_blocks(buddy, block_index, count);
+
+		block_index += count;
+		remaining -= count;
+	}
 }
 
-uint32_t mem_alloc_physical_memory(int32_t size) {
+uint32_t mem_alloc_physical_memory(int32_t size, mem_zone_t zone) {
 	int32_t num_blocks = size / MEM_PAGE_SIZE + ((size % MEM_PAGE_SIZE) != 0);
 
-	return mem_alloc_physical_blocks(num_blocks, 0, false);
+	return mem_alloc_physical_blocks(num_blocks, zone);
 }
 
 void mem_free_physical_memory(uint32_t ptr, int32_t size) {
@@ -386,6 +1016,95 @@ void mem_set_cr0(uint32_t cr0) {
 	asm volatile("mov %0, %%cr0" :: "r"(cr0));
 }
 
+// CR4 register (only the bits we use):
+// 4 	PSE	Page size extension		When set, directory entries with the page size bit map 4 MiB pages
+// 7 	PGE	Page global enabled		When set, page table entries marked global stay in the TLB when CR3 is written
+uint32_t mem_get_cr4(void) {
+	uint32_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+	return cr4;
+}
+
+void mem_set_cr4(uint32_t cr4) {
+	asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+#define CPUID_FEATURE_EDX_PSE (1 << 3)
+#define CPUID_FEATURE_EDX_PGE (1 << 13)
+#define CPUID_FEATURE_EDX_PAT (1 << 16)
+
+static
+uint32_t get_cpuid_features_edx(void) {
+	uint32_t eax = 1, ebx, ecx = 0, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+
+	return edx;
+}
+
+static bool g_global_pages_enabled;
+static bool g_large_pages_enabled;
+static bool g_pat_enabled;
+
+#define MSR_IA32_PAT 0x277
+
+#define PAT_TYPE_UNCACHED 0x00
+#define PAT_TYPE_WRITE_COMBINING 0x01
+#define PAT_TYPE_WRITE_THROUGH 0x04
+#define PAT_TYPE_WRITE_BACK 0x06
+#define PAT_TYPE_UNCACHED_MINUS 0x07 // Uncached, unless an MTRR says write-combining
+
+// Entries 0 to 3 keep their power-on types, so PCD and PWT mean the same with or without PAT
+// Entry 4 (PAT bit set) becomes write-combining, 5 to 7 mirror 1 to 3
+static const uint8_t g_pat_types[8] = {
+	PAT_TYPE_WRITE_BACK,
+	PAT_TYPE_WRITE_THROUGH,
+	PAT_TYPE_UNCACHED_MINUS,
+	PAT_TYPE_UNCACHED,
+	PAT_TYPE_WRITE_COMBINING,
+	PAT_TYPE_WRITE_THROUGH,
+	PAT_TYPE_UNCACHED_MINUS,
+	PAT_TYPE_UNCACHED,
+};
+
+static
+void write_msr(uint32_t msr, uint32_t low, uint32_t high) {
+	asm volatile("wrmsr" :: "c"(msr), "a"(low), "d"(high) : "memory");
+}
+
+// Must run before paging is enabled, so that no cached mapping uses an entry that changes
+static
+void init_pat(void) {
+	if (!(get_cpuid_features_edx() & CPUID_FEATURE_EDX_PAT)) {
+		k_printf("PAT is not supported, write-combining falls back to uncached\n");
+		return;
+	}
+
+	uint32_t low = 0;
+	uint32_t high = 0;
+	for (int i = 0; i < 4; i += 1) {
+		low |= (uint32_t)g_pat_types[i] << (i * 8);
+		high |= (uint32_t)g_pat_types[i + 4] << (i * 8);
+	}
+
+	write_msr(MSR_IA32_PAT, low, high);
+	asm volatile("wbinvd" ::: "memory");
+
+	g_pat_enabled = true;
+}
+
+// The PAT index of a page is PAT << 2 | PCD << 1 | PWT
+static
+void set_page_cache_mode(mem_page_table_entry_t *entry, mem_cache_mode_t cache_mode) {
+	if (cache_mode == MEM_CACHE_WRITE_COMBINING && !g_pat_enabled) {
+		cache_mode = MEM_CACHE_UNCACHED;
+	}
+
+	entry->enable_pat = cache_mode == MEM_CACHE_WRITE_COMBINING;
+	entry->pat_disable_caching = cache_mode == MEM_CACHE_UNCACHED;
+	entry->pat_enable_writethrough = cache_mode == MEM_CACHE_WRITE_THROUGH || cache_mode == MEM_CACHE_UNCACHED;
+}
+
 void mem_set_paging_enabled(bool enabled) {
 	if (g_paging_enabled == enabled) {
 		return;
@@ -417,8 +1136,6 @@ void mem_set_paging_enabled(bool enabled) {
 }
 
 void mem_flush_tlb() {
-	k_printf("TLB flush\n");
-
 	asm volatile("mov %%cr3, %%eax\n"
                  "mov %%eax, %%cr3\n"
                  :
@@ -426,14 +1143,101 @@ void mem_flush_tlb() {
                  : "eax", "memory");
 }
 
+// Reloading CR3 keeps global entries, toggling CR4.PGE flushes them as well
+void mem_flush_tlb_global(void) {
+	if (!g_global_pages_enabled) {
+		mem_flush_tlb();
+		return;
+	}
+
+	uint32_t cr4 = mem_get_cr4();
+	mem_set_cr4(cr4 & ~(uint32_t)(1 << 7));
+	mem_set_cr4(cr4);
+}
+
 void mem_flush_page(virt_addr_t addr) {
-	k_printf("Page flush: %p\n", addr);
+	asm volatile("invlpg (%0)" :: "r"(virt_addr_to_uint32(addr)) : "memory");
+}
+
+// Invalidations collected while updating a range of pages, flushed all at once at the end
+// Past MEM_TLB_FLUSH_THRESHOLD pages a single CR3 reload is cheaper than invlpg on each page
+#define MEM_TLB_FLUSH_THRESHOLD 32
+
+typedef struct mem_tlb_batch_t {
+	uint32_t num_pages;
+	bool has_global_pages;
+	uint32_t pages[MEM_TLB_FLUSH_THRESHOLD];
+} mem_tlb_batch_t;
+
+static
+void tlb_batch_add(mem_tlb_batch_t *batch, uint32_t addr, bool is_global) {
+	if (batch->num_pages < MEM_TLB_FLUSH_THRESHOLD) {
+		batch->pages[batch->num_pages] = addr;
+	}
+	batch->num_pages += 1;
+	batch->has_global_pages |= is_global;
+}
+
+static
+void tlb_batch_flush(mem_tlb_batch_t *batch) {
+	if (batch->num_pages > MEM_TLB_FLUSH_THRESHOLD) {
+		if (batch->has_global_pages) {
+			mem_flush_tlb_global();
+		} else {
+			mem_flush_tlb();
+		}
+	} else {
+		for (uint32_t i = 0; i < batch->num_pages; i += 1) {
+			mem_flush_page(make_virt_addr(batch->pages[i]));
+		}
+	}
+
+	batch->num_pages = 0;
+	batch->has_global_pages = false;
+}
+
+// Frames freed one by one are given back to the frame allocator as runs of contiguous frames
+// They are only given back after the TLB batch is flushed, so no stale entry can point to them
+#define MEM_FRAME_BATCH_MAX_RUNS 16
+
+typedef struct mem_frame_free_batch_t {
+	mem_tlb_batch_t *tlb_batch;
+	uint32_t num_runs;
+	mem_physical_run_t runs[MEM_FRAME_BATCH_MAX_RUNS];
+} mem_frame_free_batch_t;
+
+static
+void frame_free_batch_flush(mem_frame_free_batch_t *batch) {
+	if (batch->num_runs == 0) {
+		return;
+	}
+
+	tlb_batch_flush(batch->tlb_batch);
+
+	for (uint32_t i = 0; i < batch->num_runs; i += 1) {
+		mem_free_physical_blocks(batch->runs[i].physical_addr, batch->runs[i].num_blocks);
+	}
+
+	batch->num_runs = 0;
+}
+
+static
+void frame_free_batch_add(mem_frame_free_batch_t *batch, uint32_t frame_addr) {
+	if (batch->num_runs > 0) {
+		mem_physical_run_t *run = &batch->runs[batch->num_runs - 1];
+		if (frame_addr == run->physical_addr + run->num_blocks * MEM_PAGE_SIZE) {
+			run->num_blocks += 1;
+			return;
+		}
+	}
+
+	if (batch->num_runs == MEM_FRAME_BATCH_MAX_RUNS) {
+		frame_free_batch_flush(batch);
+	}
 
-	asm volatile(
-		"cli\n"
-		"invlpg (%0)\n"
-		"sti\n" : : "r"(addr)
-	);
+	batch->runs[batch->num_runs].physical_addr = frame_addr;
+	batch->runs[batch->num_runs].num_blocks = 1;
+	batch->num_runs += 1;
 }
 
 bool mem_change_page_dir_table(mem_page_dir_table_t *table) {
@@ -454,9 +1258,58 @@ mem_page_dir_table_t *mem_get_current_page_dir_table() {
 	return g_current_page_dir_table;
 }
 
+// Once paging is enabled, page tables are only accessed through virtual addresses:
+// the last entry of every directory points to the directory itself, so the current
+// directory is mapped at MEM_RECURSIVE_PAGE_DIR_ADDR, and its page tables are mapped at
+// MEM_RECURSIVE_MAPPING_START + directory index * MEM_PAGE_SIZE.
+// Pages of other directories are accessed through the fixed mappings.
+
+static
+mem_page_dir_table_t *get_current_page_dir_table_virt(void) {
+	// Before paging is enabled we can access physical memory directly
+	if (!g_paging_enabled) {
+		return g_current_page_dir_table;
+	}
+
+	return (mem_page_dir_table_t *)MEM_RECURSIVE_PAGE_DIR_ADDR;
+}
+
+mem_page_table_t *mem_get_page_table(virt_addr_t addr) {
+	mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(get_current_page_dir_table_virt(), addr);
+	if (!dir_entry || !dir_entry->is_present_in_physical_memory || dir_entry->pages_size_is_4_mib) {
+		return NULL;
+	}
+
+	if (!g_paging_enabled) {
+		return (mem_page_table_t *)(dir_entry->page_table_physical_addr_4KiB * MEM_PAGE_SIZE);
+	}
+
+	return (mem_page_table_t *)(MEM_RECURSIVE_MAPPING_START + addr.directory_index * MEM_PAGE_SIZE);
+}
+
+void *mem_map_fixed_page(mem_fixed_page_t fixed_page, uint32_t physical_addr) {
+	k_assert(fixed_page >= 0 && fixed_page < MEM_NUM_FIXED_PAGES, "Invalid fixed page");
+	k_assert(physical_addr % MEM_PAGE_SIZE == 0, "Physical address is not page aligned");
+
+	if (!g_paging_enabled) {
+		return (void *)physical_addr;
+	}
+
+	virt_addr_t virt_addr = make_virt_addr(MEM_FIXED_MAPPING_START + fixed_page * MEM_PAGE_SIZE);
+	mem_page_table_entry_t *entry = mem_get_page_table_entry(mem_get_page_table(virt_addr), virt_addr);
+	k_assert(entry != NULL, "Fixed mappings are not present in the current page directory");
+
+	entry->is_writable = 1;
+	entry->is_present_in_physical_memory = 1;
+	entry->physical_addr_4KiB = physical_addr / MEM_PAGE_SIZE;
+	mem_flush_page(virt_addr);
+
+	return (void *)virt_addr_to_uint32(virt_addr);
+}
+
+// Silent, the kernel half alone takes a few hundred tables at boot
 mem_page_table_t *default_page_table_alloc(void) {
-	uint32_t start_search_index = get_physical_block_index_of_addr(KERNEL_VIRT_LINEAR_MAPPING_END - KERNEL_VIRT_START) - 1;
-	uint32_t addr = mem_alloc_physical_blocks(1, start_search_index, true);
+	uint32_t addr = alloc_physical_blocks(1, MEM_ZONE_HIGH);
 	if (!addr) {
 		return NULL;
 	}
@@ -464,118 +1317,426 @@ mem_page_table_t *default_page_table_alloc(void) {
 	return (mem_page_table_t *)addr;
 }
 
-bool mem_map_page(uint32_t physical_addr, virt_addr_t virt_addr, mem_page_table_t *(*table_alloc_func)(void), bool writable) {
-	// if (physical_addr == *(uint32_t *)&virt_addr) {
-	// 	k_printf("Identity mapping %p\n", physical_addr);
-	// } else {
-	// 	k_printf("Mapping %p to %p\n", physical_addr, virt_addr);
-	// }
+// Page tables of the user half can be freed once they have no live entries left. The identity
+// and kernel page tables are shared by every directory, so they are never freed
+static
+bool is_page_table_reclaimable(virt_addr_t addr) {
+	return addr.directory_index >= MEM_NUM_LOW_MEMORY_TABLES && addr.directory_index < MEM_KERNEL_DIR_INDEX_START;
+}
 
-	bool paging_was_enabled = g_paging_enabled;
-	bool should_reset_paging = false;
+// NULL if the page table of addr is not reclaimable
+static
+mem_physical_block_info_t *get_page_table_info(virt_addr_t addr) {
+	if (!is_page_table_reclaimable(addr)) {
+		return NULL;
+	}
 
-	mem_page_dir_table_t *dir_table = mem_get_current_page_dir_table();
-	mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(dir_table, virt_addr);
-	if (!dir_entry->is_present_in_physical_memory) {
-		if (!table_alloc_func) {
-			return false;
-		}
+	mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(get_current_page_dir_table_virt(), addr);
+	k_assert(dir_entry->is_present_in_physical_memory && !dir_entry->pages_size_is_4_mib, "No page table");
 
-		// Need to allocate a new page, so make sure paging is disabled and we can
-		// access physical addresses as is
-		mem_set_paging_enabled(false);
-		should_reset_paging = true;
+	return &g_physical_block_infos[dir_entry->page_table_physical_addr_4KiB];
+}
 
-		mem_page_table_t *table = table_alloc_func();
-		if (!table) {
-			mem_set_paging_enabled(paging_was_enabled);
-			return false;
-		}
+// Free the page table of addr if it is reclaimable and has no live entries
+// Like data frames, the table frame is only freed once its cached translations are flushed
+static
+void reclaim_page_table(virt_addr_t addr, mem_frame_free_batch_t *frames) {
+	mem_physical_block_info_t *info = get_page_table_info(addr);
+	if (!info || info->page_table.num_live_entries > 0) {
+		return;
+	}
 
-		k_memset(table, 0, sizeof(mem_page_table_t));
+	mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(get_current_page_dir_table_virt(), addr);
+	uint32_t table_phys_addr = dir_entry->page_table_physical_addr_4KiB * MEM_PAGE_SIZE;
+	k_memset(dir_entry, 0, sizeof(*dir_entry));
 
-		dir_entry->page_table_physical_addr_4KiB = (uint32_t)table / MEM_PAGE_SIZE;
-		dir_entry->is_writable = 1;
-		dir_entry->is_present_in_physical_memory = 1;
+	// The recursive mapping of the table may be cached
+	tlb_batch_add(frames->tlb_batch, MEM_RECURSIVE_MAPPING_START + addr.directory_index * MEM_PAGE_SIZE, false);
+	frame_free_batch_add(frames, table_phys_addr);
+}
+
+// Get the page table mapping addr, creating it if needed
+static
+mem_page_table_t *get_or_create_page_table(virt_addr_t addr, mem_page_table_t *(*table_alloc_func)(void)) {
+	mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(get_current_page_dir_table_virt(), addr);
+	if (dir_entry->is_present_in_physical_memory) {
+		k_assert(!dir_entry->pages_size_is_4_mib, "Can't map a page inside a 4 MiB page");
+		return mem_get_page_table(addr);
 	}
 
-	mem_page_table_t *table = (mem_page_table_t *)(dir_entry->page_table_physical_addr_4KiB * MEM_PAGE_SIZE);
-	mem_page_table_entry_t *entry = mem_get_page_table_entry(table, virt_addr);
+	// A table created here would only be visible in the current directory
+	k_assert(addr.directory_index < MEM_KERNEL_DIR_INDEX_START, "Kernel page tables must be allocated with the kernel directory");
 
-	entry->is_writable = writable;
-	entry->is_present_in_physical_memory = 1;
-	entry->physical_addr_4KiB = physical_addr / MEM_PAGE_SIZE;
+	if (!table_alloc_func) {
+		return NULL;
+	}
 
-	if (should_reset_paging) {
-		mem_set_paging_enabled(paging_was_enabled);
+	mem_page_table_t *table_phys_addr = table_alloc_func();
+	if (!table_phys_addr) {
+		return NULL;
 	}
 
-	return true;
+	dir_entry->page_table_physical_addr_4KiB = (uint32_t)table_phys_addr / MEM_PAGE_SIZE;
+	dir_entry->is_writable = 1;
+	dir_entry->is_present_in_physical_memory = 1;
+
+	// The directory entry was not present, so the recursive mapping of the new table
+	// can't be in the TLB and we don't need to flush it before clearing the table
+	mem_page_table_t *table = mem_get_page_table(addr);
+	k_memset(table, 0, sizeof(mem_page_table_t));
+
+	mem_physical_block_info_t *info = get_page_table_info(addr);
+	if (info) {
+		info->page_table.num_live_entries = 0;
+	}
+
+	return table;
 }
 
-bool mem_unmap_page(virt_addr_t virt_addr) {
-	mem_page_dir_table_t *dir_table = mem_get_current_page_dir_table();
-	mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(dir_table, virt_addr);
-	if (!dir_entry->is_present_in_physical_memory) {
-		return false;
+// Map num_pages pages starting at virt_addr, walking the page tables once per directory entry
+// Frames handed out one by one from runs that are allocated in batches
+
+typedef struct mem_frame_batch_t {
+	mem_zone_t zone;
+	uint32_t num_runs;
+	uint32_t run_index;
+	uint32_t run_offset;
+	mem_physical_run_t runs[MEM_FRAME_BATCH_MAX_RUNS];
+} mem_frame_batch_t;
+
+// num_remaining is the number of frames still needed, including this one
+static
+uint32_t frame_batch_next(mem_frame_batch_t *batch, uint32_t num_remaining) {
+	if (batch->run_index >= batch->num_runs) {
+		batch->run_index = 0;
+		batch->run_offset = 0;
+		if (!mem_alloc_physical_runs(num_remaining, batch->zone, batch->runs, MEM_FRAME_BATCH_MAX_RUNS, &batch->num_runs)) {
+			return 0;
+		}
 	}
 
-	mem_page_table_t *table = (mem_page_table_t *)(dir_entry->page_table_physical_addr_4KiB * MEM_PAGE_SIZE);
-	mem_page_table_entry_t *entry = mem_get_page_table_entry(table, virt_addr);
-	if (!entry->is_present_in_physical_memory) {
-		return false;
+	mem_physical_run_t *run = &batch->runs[batch->run_index];
+	uint32_t frame_addr = run->physical_addr + batch->run_offset * MEM_PAGE_SIZE;
+
+	batch->run_offset += 1;
+	if (batch->run_offset == run->num_blocks) {
+		batch->run_index += 1;
+		batch->run_offset = 0;
 	}
 
-	entry->is_present_in_physical_memory = 0;
-	entry->physical_addr_4KiB = 0;
-	mem_flush_tlb();
+	return frame_addr;
+}
 
-	return true;
+static
+void frame_batch_free_unused(mem_frame_batch_t *batch) {
+	for (uint32_t i = batch->run_index; i < batch->num_runs; i += 1) {
+		uint32_t offset = i == batch->run_index ? batch->run_offset : 0;
+		mem_physical_run_t *run = &batch->runs[i];
+		mem_free_physical_blocks(run->physical_addr + offset * MEM_PAGE_SIZE, run->num_blocks - offset);
+	}
+
+	batch->num_runs = 0;
+	batch->run_index = 0;
+	batch->run_offset = 0;
 }
 
-mem_page_dir_table_t *mem_create_default_page_dir_table(bool user_mode) {
-	mem_page_table_t *identity_tables[] = {
-		default_page_table_alloc(),
-		default_page_table_alloc(),
-		default_page_table_alloc(),
-		default_page_table_alloc(),
-	};
+// When zone is MEM_NUM_ZONES, pages are mapped to contiguous frames starting at physical_addr,
+// otherwise frames are allocated from zone in batches of runs
+// On failure, the pages mapped so far are unmapped (and their frames freed if allocated here)
+static
+bool map_range(uint32_t physical_addr, mem_zone_t zone, virt_addr_t virt_addr, uint32_t num_pages, mem_page_table_t *(*table_alloc_func)(void), bool writable, mem_cache_mode_t cache_mode) {
+	mem_tlb_batch_t batch = {0};
+	mem_frame_batch_t frames = {0};
+	frames.zone = zone;
+
+	uint32_t addr = virt_addr_to_uint32(virt_addr);
+	uint32_t i = 0;
+	bool failed = false;
+	while (i < num_pages && !failed) {
+		mem_page_table_t *table = get_or_create_page_table(make_virt_addr(addr), table_alloc_func);
+		if (!table) {
+			failed = true;
+			break;
+		}
 
-	// Identity map the first 16 MiB of virtual address space (virt addr == phys addr)
-	uint32_t addr = 0;
-	for (int ti = 0; ti < (int)k_array_count(identity_tables); ti += 1) {
-		k_assert(identity_tables[ti] != NULL, "Physical memory allocation failure");
-		k_memset(identity_tables[ti], 0, sizeof(**identity_tables));
-
-		for (int32_t i = 0; i < MEM_NUM_PAGE_TABLE_ENTRIES; i += 1) {
-			mem_page_table_entry_t *entry = mem_get_page_table_entry(identity_tables[ti], make_virt_addr(addr));
-			k_assert(entry != NULL, "");
-
-			if (addr >= get_kernel_text_start_phys_addr() && addr <= get_kernel_text_end_phys_addr()) {
-				entry->is_writable = 0;
-			} else if (addr >= get_kernel_rodata_start_phys_addr() && addr <= get_kernel_rodata_end_phys_addr()) {
-				entry->is_writable = 0;
+		mem_physical_block_info_t *table_info = get_page_table_info(make_virt_addr(addr));
+
+		// Map pages until the end of this page table
+		for (; i < num_pages; i += 1) {
+			virt_addr_t page_addr = make_virt_addr(addr);
+
+			uint32_t frame_addr;
+			if (zone == MEM_NUM_ZONES) {
+				frame_addr = physical_addr + i * MEM_PAGE_SIZE;
 			} else {
-				entry->is_writable = 1;
+				frame_addr = frame_batch_next(&frames, num_pages - i);
+				if (!frame_addr) {
+					failed = true;
+					break;
+				}
+			}
+
+			mem_page_table_entry_t *entry = mem_get_page_table_entry(table, page_addr);
+
+			// Entries that are not present are not cached, so we only need to flush when replacing a mapping
+			if (entry->is_present_in_physical_memory) {
+				tlb_batch_add(&batch, addr, entry->is_cpu_global);
+			} else if (!entry->is_demand_zero && table_info) {
+				table_info->page_table.num_live_entries += 1;
 			}
+
+			// The kernel linear mapping is the same in every directory
+			entry->is_cpu_global = addr >= KERNEL_VIRT_LINEAR_MAPPING_START && addr < KERNEL_VIRT_LINEAR_MAPPING_END;
+			entry->is_demand_zero = 0;
+			entry->is_writable = writable;
 			entry->is_present_in_physical_memory = 1;
-			entry->physical_addr_4KiB = addr / MEM_PAGE_SIZE;
-			entry->is_user_mode = user_mode;
+			entry->physical_addr_4KiB = frame_addr / MEM_PAGE_SIZE;
+			set_page_cache_mode(entry, cache_mode);
 
 			addr += MEM_PAGE_SIZE;
+
+			if (page_addr.page_index == MEM_NUM_PAGE_TABLE_ENTRIES - 1) {
+				i += 1;
+				break;
+			}
 		}
 	}
 
-	mem_page_table_t *kernel_table = default_page_table_alloc();
-	k_assert(kernel_table != NULL, "Physical memory allocation failure");
+	tlb_batch_flush(&batch);
 
-	k_memset(kernel_table, 0, sizeof(*kernel_table));
+	if (failed) {
+		// A page table allocation may fail with frames left in the batch
+		frame_batch_free_unused(&frames);
+		mem_unmap_range(virt_addr, i, zone != MEM_NUM_ZONES);
+		return false;
+	}
+
+	return true;
+}
+
+bool mem_map_range(uint32_t physical_addr, virt_addr_t virt_addr, uint32_t num_pages, mem_page_table_t *(*table_alloc_func)(void), bool writable) {
+	k_assert(physical_addr % MEM_PAGE_SIZE == 0, "Physical address is not page aligned");
+
+	return map_range(physical_addr, MEM_NUM_ZONES, virt_addr, num_pages, table_alloc_func, writable, MEM_CACHE_WRITE_BACK);
+}
+
+bool mem_map_range_cache_mode(uint32_t physical_addr, virt_addr_t virt_addr, uint32_t num_pages, mem_page_table_t *(*table_alloc_func)(void), bool writable, mem_cache_mode_t cache_mode) {
+	k_assert(physical_addr % MEM_PAGE_SIZE == 0, "Physical address is not page aligned");
+	k_assert(cache_mode >= 0 && cache_mode < MEM_NUM_CACHE_MODES, "Invalid cache mode");
+
+	return map_range(physical_addr, MEM_NUM_ZONES, virt_addr, num_pages, table_alloc_func, writable, cache_mode);
+}
+
+uint32_t mem_set_range_cache_mode(virt_addr_t virt_addr, uint32_t num_pages, mem_cache_mode_t cache_mode) {
+	k_assert(cache_mode >= 0 && cache_mode < MEM_NUM_CACHE_MODES, "Invalid cache mode");
+
+	mem_tlb_batch_t batch = {0};
+	uint32_t num_changed = 0;
+
+	uint32_t addr = virt_addr_to_uint32(virt_addr);
+	for (uint32_t i = 0; i < num_pages; i += 1) {
+		virt_addr_t page_addr = make_virt_addr(addr);
+
+		mem_page_table_entry_t *entry = mem_get_page_table_entry(mem_get_page_table(page_addr), page_addr);
+		if (entry && entry->is_present_in_physical_memory) {
+			set_page_cache_mode(entry, cache_mode);
+			tlb_batch_add(&batch, addr, entry->is_cpu_global);
+			num_changed += 1;
+		}
+
+		addr += MEM_PAGE_SIZE;
+	}
+
+	// Lines cached under the old type must not be written back later
+	tlb_batch_flush(&batch);
+	asm volatile("wbinvd" ::: "memory");
+
+	return num_changed;
+}
+
+bool mem_map_range_alloc(virt_addr_t virt_addr, uint32_t num_pages, mem_zone_t zone, mem_page_table_t *(*table_alloc_func)(void), bool writable) {
+	k_assert(zone >= 0 && zone < MEM_NUM_ZONES, "Invalid memory zone");
+
+	return map_range(0, zone, virt_addr, num_pages, table_alloc_func, writable, MEM_CACHE_WRITE_BACK);
+}
+
+static
+uint32_t unmap_range(virt_addr_t virt_addr, uint32_t num_pages, bool free_frames, mem_tlb_batch_t *batch, mem_frame_free_batch_t *frames) {
+	uint32_t num_unmapped = 0;
+
+	uint32_t addr = virt_addr_to_uint32(virt_addr);
+	uint32_t i = 0;
+	while (i < num_pages) {
+		virt_addr_t table_addr = make_virt_addr(addr);
+		mem_page_table_t *table = mem_get_page_table(table_addr);
+		mem_physical_block_info_t *table_info = table ? get_page_table_info(table_addr) : NULL;
+
+		// Walk the pages until the end of this page table
+		for (; i < num_pages; i += 1) {
+			virt_addr_t page_addr = make_virt_addr(addr);
+			addr += MEM_PAGE_SIZE;
+
+			mem_page_table_entry_t *entry = mem_get_page_table_entry(table, page_addr);
+			if (entry && entry->is_demand_zero) {
+				k_assert(!entry->is_present_in_physical_memory, "Demand-zero page is present");
+
+				entry->is_demand_zero = 0;
+				entry->physical_addr_4KiB = 0;
+				num_unmapped += 1;
+
+				if (table_info) {
+					table_info->page_table.num_live_entries -= 1;
+				}
+			} else if (entry && entry->is_present_in_physical_memory) {
+				if (free_frames) {
+					frame_free_batch_add(frames, entry->physical_addr_4KiB * MEM_PAGE_SIZE);
+				}
+
+				bool is_global = entry->is_cpu_global;
+				entry->is_present_in_physical_memory = 0;
+				entry->is_cpu_global = 0;
+				entry->physical_addr_4KiB = 0;
+				set_page_cache_mode(entry, MEM_CACHE_WRITE_BACK);
+
+				tlb_batch_add(batch, virt_addr_to_uint32(page_addr), is_global);
+				num_unmapped += 1;
+
+				if (table_info) {
+					table_info->page_table.num_live_entries -= 1;
+				}
+			}
+
+			if (page_addr.page_index == MEM_NUM_PAGE_TABLE_ENTRIES - 1) {
+				i += 1;
+				break;
+			}
+		}
+
+		if (table) {
+			reclaim_page_table(table_addr, frames);
+		}
+	}
+
+	return num_unmapped;
+}
+
+uint32_t mem_unmap_range(virt_addr_t virt_addr, uint32_t num_pages, bool free_frames) {
+	mem_virt_range_t range = {virt_addr, num_pages};
+
+	return mem_unmap_ranges(&range, 1, free_frames);
+}
+
+uint32_t mem_unmap_ranges(const mem_virt_range_t *ranges, uint32_t num_ranges, bool free_frames) {
+	mem_tlb_batch_t batch = {0};
+	mem_frame_free_batch_t frames = {0};
+	frames.tlb_batch = &batch;
+	uint32_t num_unmapped = 0;
+
+	for (uint32_t i = 0; i < num_ranges; i += 1) {
+		num_unmapped += unmap_range(ranges[i].virt_addr, ranges[i].num_pages, free_frames, &batch, &frames);
+	}
+
+	// Frames are given back once no stale TLB entry can point to them
+	tlb_batch_flush(&batch);
+	frame_free_batch_flush(&frames);
+
+	return num_unmapped;
+}
+
+bool mem_map_range_demand_zero(virt_addr_t virt_addr, uint32_t num_pages, mem_zone_t zone, mem_page_table_t *(*table_alloc_func)(void), bool writable) {
+	k_assert(zone >= 0 && zone < MEM_NUM_ZONES, "Invalid memory zone");
+
+	uint32_t addr = virt_addr_to_uint32(virt_addr);
+	uint32_t i = 0;
+	while (i < num_pages) {
+		mem_page_table_t *table = get_or_create_page_table(make_virt_addr(addr), table_alloc_func);
+		if (!table) {
+			mem_unmap_range(virt_addr, i, false);
+			return false;
+		}
+
+		mem_physical_block_info_t *table_info = get_page_table_info(make_virt_addr(addr));
+
+		// Not present entries are not cached, so there is nothing to flush
+		for (; i < num_pages; i += 1) {
+			virt_addr_t page_addr = make_virt_addr(addr);
+			addr += MEM_PAGE_SIZE;
+
+			mem_page_table_entry_t *entry = mem_get_page_table_entry(table, page_addr);
+			k_assert(!entry->is_present_in_physical_memory && !entry->is_demand_zero, "Page is already mapped");
+
+			entry->is_demand_zero = 1;
+			entry->is_writable = writable;
+			entry->physical_addr_4KiB = zone;
+
+			if (table_info) {
+				table_info->page_table.num_live_entries += 1;
+			}
+
+			if (page_addr.page_index == MEM_NUM_PAGE_TABLE_ENTRIES - 1) {
+				i += 1;
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool mem_handle_page_fault(uint32_t virt_addr, bool user_mode) {
+	mem_page_table_entry_t *entry = mem_get_page_table_entry(mem_get_page_table(make_virt_addr(virt_addr)), make_virt_addr(virt_addr));
+	if (!entry || entry->is_present_in_physical_memory || !entry->is_demand_zero) {
+		return false;
+	}
+
+	// User code must not get a frame for a kernel page, the access is only allowed if both levels are user pages
+	if (user_mode) {
+		mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(get_current_page_dir_table_virt(), make_virt_addr(virt_addr));
+		if (!dir_entry->is_user_mode || !entry->is_user_mode) {
+			return false;
+		}
+	}
+
+	uint32_t frame_addr = alloc_physical_blocks(1, (mem_zone_t)entry->physical_addr_4KiB);
+	if (!frame_addr) {
+		k_printf("Out of physical memory for demand-zero page %p\n", virt_addr);
+		return false;
+	}
+
+	// Map it writable to clear it, the page was not present so there is nothing to flush yet
+	bool writable = entry->is_writable;
+	entry->is_demand_zero = 0;
+	entry->is_writable = 1;
+	entry->physical_addr_4KiB = frame_addr / MEM_PAGE_SIZE;
+	entry->is_present_in_physical_memory = 1;
+
+	uint32_t page_addr = virt_addr & ~(uint32_t)(MEM_PAGE_SIZE - 1);
+	k_memset((void *)page_addr, 0, MEM_PAGE_SIZE);
+
+	if (!writable) {
+		entry->is_writable = 0;
+		mem_flush_page(make_virt_addr(page_addr));
+	}
+
+	return true;
+}
+
+bool mem_map_page(uint32_t physical_addr, virt_addr_t virt_addr, mem_page_table_t *(*table_alloc_func)(void), bool writable) {
+	return mem_map_range(physical_addr, virt_addr, 1, table_alloc_func, writable);
+}
+
+bool mem_unmap_page(virt_addr_t virt_addr) {
+	return mem_unmap_range(virt_addr, 1, false) == 1;
+}
+
+// Fill a page table mapping 4 MiB of virtual memory starting at virt_addr to physical memory
+// starting at phys_addr, with the kernel text and rodata write-protected
+static
+void fill_low_memory_page_table(mem_page_table_t *table, uint32_t phys_addr, uint32_t virt_addr, bool user_mode, bool global) {
+	k_memset(table, 0, sizeof(*table));
 
-	// Map the kernel (first 4 MiB) to virtual address space 3 GiB
-	uint32_t phys_addr = 0;
-	uint32_t virt_addr = KERNEL_VIRT_START;
 	for (int32_t i = 0; i < MEM_NUM_PAGE_TABLE_ENTRIES; i += 1) {
-		mem_page_table_entry_t *entry = mem_get_page_table_entry(kernel_table, make_virt_addr(virt_addr));
+		mem_page_table_entry_t *entry = mem_get_page_table_entry(table, make_virt_addr(virt_addr));
 		k_assert(entry != NULL, "");
 
 		if (phys_addr >= get_kernel_text_start_phys_addr() && phys_addr <= get_kernel_text_end_phys_addr()) {
@@ -585,45 +1746,170 @@ mem_page_dir_table_t *mem_create_default_page_dir_table(bool user_mode) {
 		} else {
 			entry->is_writable = 1;
 		}
-
 		entry->is_present_in_physical_memory = 1;
 		entry->physical_addr_4KiB = phys_addr / MEM_PAGE_SIZE;
 		entry->is_user_mode = user_mode;
+		entry->is_cpu_global = global;
 
 		virt_addr += MEM_PAGE_SIZE;
 		phys_addr += MEM_PAGE_SIZE;
 	}
+}
+
+// The kernel directory owns the page tables shared by every directory: the identity mapping
+// of the first 16 MiB, and all the page tables of the kernel half, which are allocated up
+// front so that kernel mappings added later (kbrk, vmalloc) are visible in every directory
+static
+mem_page_dir_table_t *create_kernel_page_dir_table(void) {
+	// The first 4 MiB contain the kernel text and rodata, which must stay write-protected,
+	// so they are always mapped with 4 KiB pages. With large pages, the rest of the first
+	// 16 MiB is mapped with 4 MiB pages and needs no page table at all
+	int num_identity_tables = g_large_pages_enabled ? 1 : MEM_NUM_LOW_MEMORY_TABLES;
+	uint32_t identity_tables[MEM_NUM_LOW_MEMORY_TABLES] = {0};
+
+	// Identity map the first 16 MiB of virtual address space (virt addr == phys addr)
+	for (int ti = 0; ti < num_identity_tables; ti += 1) {
+		identity_tables[ti] = (uint32_t)default_page_table_alloc();
+		k_assert(identity_tables[ti] != 0, "Physical memory allocation failure");
+
+		mem_page_table_t *identity_table = mem_map_fixed_page(MEM_FIXED_PAGE_TABLE, identity_tables[ti]);
+		uint32_t addr = ti * MEM_NUM_PAGE_TABLE_ENTRIES * MEM_PAGE_SIZE;
+
+		// The entries are user accessible, the directory entries decide whether user mode can access them
+		fill_low_memory_page_table(identity_table, addr, addr, true, false);
+	}
+
+	uint32_t kernel_table_phys_addr = (uint32_t)default_page_table_alloc();
+	k_assert(kernel_table_phys_addr != 0, "Physical memory allocation failure");
+
+	// Map the kernel (first 4 MiB) to virtual address space 3 GiB
+	// These mappings are identical in every directory, so they are global (they stay in the TLB
+	// when switching directories) and only accessible from the kernel
+	mem_page_table_t *kernel_table = mem_map_fixed_page(MEM_FIXED_PAGE_TABLE, kernel_table_phys_addr);
+	fill_low_memory_page_table(kernel_table, 0, KERNEL_VIRT_START, false, true);
 
 	// Create a directory table
-	mem_page_dir_table_t *dir_table = (mem_page_dir_table_t *)mem_alloc_physical_memory(sizeof(mem_page_dir_table_t));
-	k_assert(dir_table != NULL, "Memory allocation failure");
+	uint32_t dir_table_phys_addr = mem_alloc_physical_memory(sizeof(mem_page_dir_table_t), MEM_ZONE_HIGH);
+	k_assert(dir_table_phys_addr != 0, "Memory allocation failure");
 
+	mem_page_dir_table_t *dir_table = mem_map_fixed_page(MEM_FIXED_PAGE_DIR, dir_table_phys_addr);
 	k_memset(dir_table, 0, sizeof(*dir_table));
 
-	uint32_t identity_addr = 0;
-	for (int i = 0; i < (int)k_array_count(identity_tables); i += 1) {
-		mem_page_dir_entry_t *identity_dir = mem_get_page_dir_entry(dir_table, make_virt_addr(identity_addr));
+	for (int i = 0; i < MEM_NUM_LOW_MEMORY_TABLES; i += 1) {
+		uint32_t addr = i * MEM_NUM_PAGE_TABLE_ENTRIES * MEM_PAGE_SIZE;
+
+		mem_page_dir_entry_t *identity_dir = mem_get_page_dir_entry(dir_table, make_virt_addr(addr));
 		k_assert(identity_dir != NULL, "");
 
 		identity_dir->is_present_in_physical_memory = 1;
 		identity_dir->is_writable = 1;
-		identity_dir->page_table_physical_addr_4KiB = (uint32_t)identity_tables[i] / MEM_PAGE_SIZE;
-		identity_dir->is_user_mode = user_mode;
 
-		identity_addr += MEM_NUM_PAGE_TABLE_ENTRIES * MEM_PAGE_SIZE;
+		if (i < num_identity_tables) {
+			identity_dir->page_table_physical_addr_4KiB = identity_tables[i] / MEM_PAGE_SIZE;
+		} else {
+			identity_dir->pages_size_is_4_mib = 1;
+			identity_dir->page_table_physical_addr_4KiB = addr / MEM_PAGE_SIZE;
+		}
 	}
 
 	mem_page_dir_entry_t *kernel_dir = mem_get_page_dir_entry(dir_table, make_virt_addr(KERNEL_VIRT_START));
 	k_assert(kernel_dir != NULL, "");
 	kernel_dir->is_present_in_physical_memory = 1;
 	kernel_dir->is_writable = 1;
-	kernel_dir->page_table_physical_addr_4KiB = (uint32_t)kernel_table / MEM_PAGE_SIZE;
-	kernel_dir->is_user_mode = user_mode;
+	kernel_dir->page_table_physical_addr_4KiB = kernel_table_phys_addr / MEM_PAGE_SIZE;
+
+	// Map the rest of the kernel linear mapping, kbrk then only needs to claim physical blocks
+	if (g_large_pages_enabled) {
+		for (int i = 1; i < MEM_NUM_LOW_MEMORY_TABLES; i += 1) {
+			uint32_t phys_addr = i * MEM_NUM_PAGE_TABLE_ENTRIES * MEM_PAGE_SIZE;
+
+			mem_page_dir_entry_t *linear_dir = mem_get_page_dir_entry(dir_table, make_virt_addr(KERNEL_VIRT_START + phys_addr));
+			linear_dir->is_present_in_physical_memory = 1;
+			linear_dir->is_writable = 1;
+			linear_dir->pages_size_is_4_mib = 1;
+			linear_dir->is_cpu_global = 1;
+			linear_dir->page_table_physical_addr_4KiB = phys_addr / MEM_PAGE_SIZE;
+		}
+	}
+
+	// Allocate the remaining page tables of the kernel half
+	for (uint32_t i = MEM_KERNEL_DIR_INDEX_START; i < MEM_FIXED_MAPPING_DIR_INDEX; i += 1) {
+		mem_page_dir_entry_t *dir_entry = &dir_table->entries[i];
+		if (dir_entry->is_present_in_physical_memory) {
+			continue;
+		}
+
+		uint32_t table_phys_addr = (uint32_t)default_page_table_alloc();
+		k_assert(table_phys_addr != 0, "Physical memory allocation failure");
+
+		mem_page_table_t *table = mem_map_fixed_page(MEM_FIXED_PAGE_TABLE, table_phys_addr);
+		k_memset(table, 0, sizeof(*table));
+
+		dir_entry->is_present_in_physical_memory = 1;
+		dir_entry->is_writable = 1;
+		dir_entry->page_table_physical_addr_4KiB = table_phys_addr / MEM_PAGE_SIZE;
+	}
+
+	mem_page_dir_entry_t *fixed_mapping_dir = mem_get_page_dir_entry(dir_table, make_virt_addr(MEM_FIXED_MAPPING_START));
+	fixed_mapping_dir->is_present_in_physical_memory = 1;
+	fixed_mapping_dir->is_writable = 1;
+	fixed_mapping_dir->page_table_physical_addr_4KiB = g_fixed_mapping_page_table / MEM_PAGE_SIZE;
 
-	return dir_table;
+	mem_page_dir_entry_t *recursive_dir = mem_get_page_dir_entry(dir_table, make_virt_addr(MEM_RECURSIVE_MAPPING_START));
+	recursive_dir->is_present_in_physical_memory = 1;
+	recursive_dir->is_writable = 1;
+	recursive_dir->page_table_physical_addr_4KiB = dir_table_phys_addr / MEM_PAGE_SIZE;
+
+	return (mem_page_dir_table_t *)dir_table_phys_addr;
+}
+
+mem_page_dir_table_t *mem_create_default_page_dir_table(bool user_mode) {
+	uint32_t dir_table_phys_addr = mem_alloc_physical_memory(sizeof(mem_page_dir_table_t), MEM_ZONE_HIGH);
+	if (!dir_table_phys_addr) {
+		return NULL;
+	}
+
+	mem_page_dir_table_t *kernel_dir_table = mem_map_fixed_page(MEM_FIXED_PAGE_KERNEL_DIR, (uint32_t)g_kernel_dir_table);
+	mem_page_dir_table_t *dir_table = mem_map_fixed_page(MEM_FIXED_PAGE_DIR, dir_table_phys_addr);
+	k_memset(dir_table, 0, sizeof(*dir_table));
+
+	// Share the identity mapping, only the directory entries decide if user mode can access it
+	for (int i = 0; i < MEM_NUM_LOW_MEMORY_TABLES; i += 1) {
+		dir_table->entries[i] = kernel_dir_table->entries[i];
+		dir_table->entries[i].is_user_mode = user_mode;
+	}
+
+	// Share the kernel half (including the fixed mappings)
+	k_memcpy(&dir_table->entries[MEM_KERNEL_DIR_INDEX_START], &kernel_dir_table->entries[MEM_KERNEL_DIR_INDEX_START], (MEM_RECURSIVE_DIR_INDEX - MEM_KERNEL_DIR_INDEX_START) * sizeof(mem_page_dir_entry_t));
+
+	mem_page_dir_entry_t *recursive_dir = &dir_table->entries[MEM_RECURSIVE_DIR_INDEX];
+	recursive_dir->is_present_in_physical_memory = 1;
+	recursive_dir->is_writable = 1;
+	recursive_dir->page_table_physical_addr_4KiB = dir_table_phys_addr / MEM_PAGE_SIZE;
+
+	return (mem_page_dir_table_t *)dir_table_phys_addr;
+}
+
+void mem_destroy_page_dir_table(mem_page_dir_table_t *table) {
+	if (!table) {
+		return;
+	}
+
+	k_assert(table != g_kernel_dir_table, "Can't destroy the kernel page directory");
+	k_assert(table != g_current_page_dir_table, "Can't destroy the current page directory");
+
+	// Free the page tables of the user half, the rest is shared with the kernel directory
+	mem_page_dir_table_t *dir_table = mem_map_fixed_page(MEM_FIXED_PAGE_DIR, (uint32_t)table);
+	for (uint32_t i = MEM_NUM_LOW_MEMORY_TABLES; i < MEM_KERNEL_DIR_INDEX_START; i += 1) {
+		mem_page_dir_entry_t *dir_entry = &dir_table->entries[i];
+		if (dir_entry->is_present_in_physical_memory && !dir_entry->pages_size_is_4_mib) {
+			mem_free_physical_blocks(dir_entry->page_table_physical_addr_4KiB * MEM_PAGE_SIZE, 1);
+		}
+	}
+
+	mem_free_physical_blocks((uint32_t)table, 1);
 }
 
-static mem_page_dir_table_t *g_kernel_dir_table;
 
 void mem_switch_to_kernel_mode(void) {
 	mem_change_page_dir_table(g_kernel_dir_table);
@@ -631,7 +1917,22 @@ void mem_switch_to_kernel_mode(void) {
 
 static
 void init_virtual_memory() {
-	g_kernel_dir_table = mem_create_default_page_dir_table(false);
+	// Large pages must be enabled before paging, since the default directory uses them
+	if (get_cpuid_features_edx() & CPUID_FEATURE_EDX_PSE) {
+		mem_set_cr4(mem_get_cr4() | (1 << 4));
+		g_large_pages_enabled = true;
+	} else {
+		k_printf("Large pages are not supported\n");
+	}
+
+	init_pat();
+
+	// Shared by all directories
+	g_fixed_mapping_page_table = (uint32_t)default_page_table_alloc();
+	k_assert(g_fixed_mapping_page_table != 0, "Physical memory allocation failure");
+	k_memset((void *)g_fixed_mapping_page_table, 0, sizeof(mem_page_table_t));
+
+	g_kernel_dir_table = create_kernel_page_dir_table();
 	mem_change_page_dir_table(g_kernel_dir_table);
 	mem_set_paging_enabled(true);
 
@@ -639,7 +1940,15 @@ void init_virtual_memory() {
 	uint32_t cr0 = mem_get_cr0();
 	mem_set_cr0(cr0 | (1 << 16));
 
-	g_kernel_brk = (void *)(KERNEL_VIRT_START + 0x400000);
+	// Enable global pages
+	if (get_cpuid_features_edx() & CPUID_FEATURE_EDX_PGE) {
+		mem_set_cr4(mem_get_cr4() | (1 << 7));
+		g_global_pages_enabled = true;
+	} else {
+		k_printf("Global pages are not supported\n");
+	}
+
+	g_kernel_brk = (void *)(KERNEL_VIRT_START + g_kernel_brk_phys_start);
 
 	{
 		uint32_t value = 0xbadcafe;
@@ -690,31 +1999,46 @@ void *kbrk(k_size_t increment) {
 	}
 
 	for (uint32_t i = phys_brk_page; i < phys_brk_page + num_pages_increment; i += 1) {
-		mark_physical_block_as_used(i);
+		claim_physical_block(i);
+	}
+
+	// With large pages the whole linear mapping is already mapped
+	if (!g_large_pages_enabled) {
 		// Identity map
-		mem_map_page(phys_brk, make_virt_addr(phys_brk), default_page_table_alloc, true);
+		bool mapped = mem_map_range(phys_brk, make_virt_addr(phys_brk), num_pages_increment, default_page_table_alloc, true);
 		// Kernel map
-		mem_map_page(phys_brk, make_virt_addr((uint32_t)g_kernel_brk), default_page_table_alloc, true);
-
-		phys_brk += MEM_PAGE_SIZE;
-		g_kernel_brk += MEM_PAGE_SIZE;
+		mapped = mapped && mem_map_range(phys_brk, make_virt_addr((uint32_t)g_kernel_brk), num_pages_increment, default_page_table_alloc, true);
+		k_assert(mapped, "kbrk: page table allocation failure");
 	}
 
+	g_kernel_brk += increment_page_size;
+
 	return g_kernel_brk;
 }
 
 void mem_print_virtual_memory_map(void) {
-	mem_page_dir_table_t *dir_table = mem_get_current_page_dir_table();
 	uint32_t addr = 0;
 	for (int i = 0; i < 1024; i += 1) {
-		mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(dir_table, make_virt_addr(addr));
-		if (dir_entry->is_present_in_physical_memory) {
-			mem_page_table_t *table = (mem_page_table_t *)(dir_entry->page_table_physical_addr_4KiB * MEM_PAGE_SIZE);
+		// Skip the recursive mapping, its pages are the page tables
+		if (addr == MEM_RECURSIVE_MAPPING_START) {
+			k_printf("Page tables (recursive mapping) at %p\n", addr);
+			break;
+		}
+
+		mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(get_current_page_dir_table_virt(), make_virt_addr(addr));
+		if (dir_entry->is_present_in_physical_memory && dir_entry->pages_size_is_4_mib) {
+			k_printf("Page %p -> %p (4 MiB), writable=%u, user=%u, global=%u\n", addr, dir_entry->page_table_physical_addr_4KiB * MEM_PAGE_SIZE, dir_entry->is_writable, dir_entry->is_user_mode, dir_entry->is_cpu_global);
+			addr += 1024 * MEM_PAGE_SIZE;
+			continue;
+		}
+
+		mem_page_table_t *table = mem_get_page_table(make_virt_addr(addr));
+		if (table) {
 			for (int j = 0; j < 1024; j += 1) {
 				mem_page_table_entry_t *table_entry = mem_get_page_table_entry(table, make_virt_addr(addr));
 
 				if (table_entry->is_present_in_physical_memory) {
-					k_printf("Page %p -> %p, writable=%u, user=%u, accessed=%u, written=%u\n", addr, table_entry->physical_addr_4KiB * MEM_PAGE_SIZE, table_entry->is_writable, table_entry->is_user_mode, table_entry->has_been_accessed, table_entry->has_been_written_to);
+					k_printf("Page %p -> %p, writable=%u, user=%u, global=%u, accessed=%u, written=%u\n", addr, table_entry->physical_addr_4KiB * MEM_PAGE_SIZE, table_entry->is_writable, table_entry->is_user_mode, table_entry->is_cpu_global, table_entry->has_been_accessed, table_entry->has_been_written_to);
 				}
 
 				addr += MEM_PAGE_SIZE;
@@ -8,6 +8,19 @@
 #define KERNEL_VIRT_END   0xc0400000
 #define KERNEL_VIRT_LINEAR_MAPPING_START KERNEL_VIRT_START
 #define KERNEL_VIRT_LINEAR_MAPPING_END (KERNEL_VIRT_START + 16 * 1024 * 1024)
+#define MEM_NUM_LOW_MEMORY_TABLES 4 // Page tables (or 4 MiB pages) needed to map the first 16 MiB
+
+// The last 4 MiB of virtual address space map the page tables of the current directory
+// (the last directory entry points to the directory itself), and the 4 MiB below are
+// reserved for fixed mappings
+#define MEM_FIXED_MAPPING_START 0xff800000
+#define MEM_RECURSIVE_MAPPING_START 0xffc00000
+#define MEM_RECURSIVE_PAGE_DIR_ADDR 0xfffff000
+
+// Directory entries of the kernel half, which are the same in every directory
+#define MEM_KERNEL_DIR_INDEX_START (KERNEL_VIRT_START >> 22)
+#define MEM_FIXED_MAPPING_DIR_INDEX (MEM_FIXED_MAPPING_START >> 22)
+#define MEM_RECURSIVE_DIR_INDEX (MEM_RECURSIVE_MAPPING_START >> 22)
 
 uintptr_t get_kernel_start_phys_addr(void);
 uintptr_t get_kernel_end_phys_addr(void);
@@ -19,10 +32,30 @@ uint32_t mem_get_total_physical_blocks(void);
 uint32_t mem_get_remaining_physical_memory(void);
 uint32_t mem_get_total_physical_memory(void);
 
-void mark_physical_block_as_used(uint32_t block_index);
-uint32_t mem_alloc_physical_blocks(int32_t num_blocks, uint32_t start_block_index, bool reverse_search);
+// Physical memory zones, allocations fall back to the zones below the requested one
+// when it is exhausted. The kernel linear mapping covers the first 16 MiB, which is
+// also the range ISA DMA can reach, so the DMA zone is the part of it below kbrk
+typedef enum mem_zone_t {
+	MEM_ZONE_DMA,    // Below the start of kbrk (kernel binary, low memory)
+	MEM_ZONE_LINEAR, // Rest of the kernel linear mapping, kbrk grows upward and other allocations are taken from the top
+	MEM_ZONE_HIGH,   // Everything above the kernel linear mapping
+	MEM_NUM_ZONES,
+} mem_zone_t;
+
+uint32_t mem_get_free_physical_blocks_in_zone(mem_zone_t zone);
+
+uint32_t mem_alloc_physical_blocks(int32_t num_blocks, mem_zone_t zone);
 void mem_free_physical_blocks(uint32_t block, int32_t num_blocks);
-uint32_t mem_alloc_physical_memory(int32_t size);
+uint32_t mem_alloc_physical_memory(int32_t size, mem_zone_t zone);
+
+typedef struct mem_physical_run_t {
+	uint32_t physical_addr;
+	uint32_t num_blocks;
+} mem_physical_run_t;
+
+// Allocate up to num_blocks blocks that don't need to be contiguous in one pass, as at most max_runs runs
+// Returns the number of blocks allocated, fewer than num_blocks when the runs or the memory ran out
+uint32_t mem_alloc_physical_runs(uint32_t num_blocks, mem_zone_t zone, mem_physical_run_t *runs, uint32_t max_runs, uint32_t *num_runs);
 void mem_free_physical_memory(uint32_t ptr, int32_t size);
 
 void mem_print_physical_memory_map(void);
@@ -60,7 +93,8 @@ typedef struct mem_page_table_entry_t {
     uint32_t has_been_written_to : 1; // Set by the MMU, can be reset by the kernel
     uint32_t enable_pat : 1; // Only supported since Pentium3
     uint32_t is_cpu_global : 1;
-    uint32_t unused : 3;
+    uint32_t is_demand_zero : 1; // Ignored by the MMU, not present page to allocate on first access (physical_addr_4KiB holds the zone)
+    uint32_t unused : 2;
     uint32_t physical_addr_4KiB : 20; // Physical address divided by 4096 (this is why we can have only 20 bits)
 } mem_page_table_entry_t;
 
@@ -75,7 +109,7 @@ typedef struct mem_page_dir_entry_t {
     uint32_t pages_size_is_4_mib : 1;
     uint32_t is_cpu_global : 1;
     uint32_t unused : 3;
-    uint32_t page_table_physical_addr_4KiB : 19; // Physical address divided by 4096 (this is why we can have only 19 bits)
+    uint32_t page_table_physical_addr_4KiB : 20; // Physical address divided by 4096 (this is why we can have only 20 bits)
 } mem_page_dir_entry_t;
 
 #define MEM_NUM_PAGE_TABLE_ENTRIES 1024
@@ -93,23 +127,81 @@ typedef struct mem_page_dir_table_t {
 mem_page_table_entry_t *mem_get_page_table_entry(mem_page_table_t *table, virt_addr_t addr);
 mem_page_dir_entry_t *mem_get_page_dir_entry(mem_page_dir_table_t *table, virt_addr_t addr);
 
+// Get the page table that maps addr in the current directory (through the recursive mapping),
+// NULL if it is not present or if addr is in a 4 MiB page
+mem_page_table_t *mem_get_page_table(virt_addr_t addr);
+
+typedef enum mem_fixed_page_t {
+	MEM_FIXED_PAGE_TABLE, // Page table of a directory that is not the current one
+	MEM_FIXED_PAGE_DIR,   // Directory that is not the current one
+	MEM_FIXED_PAGE_KERNEL_DIR, // The kernel directory, when creating another directory
+	MEM_NUM_FIXED_PAGES,
+} mem_fixed_page_t;
+
+// Map a physical page to the fixed virtual page, replacing its previous mapping
+void *mem_map_fixed_page(mem_fixed_page_t fixed_page, uint32_t physical_addr);
+
 uint32_t mem_get_cr0(void);
 void mem_set_cr0(uint32_t cr0);
+uint32_t mem_get_cr4(void);
+void mem_set_cr4(uint32_t cr4);
 void mem_set_paging_enabled(bool enabled);
+// Does not flush global pages (the kernel mappings)
 void mem_flush_tlb(void);
+// Flush everything, including global pages
+void mem_flush_tlb_global(void);
 void mem_flush_page(virt_addr_t addr);
 bool mem_change_page_dir_table(mem_page_dir_table_t *table);
 mem_page_dir_table_t *mem_get_current_page_dir_table(void);
 void mem_switch_to_kernel_mode(void);
+// Only allocates the directory, the identity mapping and the kernel half are shared with the kernel directory
 mem_page_dir_table_t *mem_create_default_page_dir_table(bool user_mode);
+void mem_destroy_page_dir_table(mem_page_dir_table_t *table);
 
 // Default page table alloc function, that avoids eating memory for kbrk
-// Returns a physical address, since it's used in a context where paging is disabled
+// Returns a physical address, the table is accessed through the recursive mapping
 mem_page_table_t *default_page_table_alloc(void);
 
 bool mem_map_page(uint32_t physical_addr, virt_addr_t virt_addr, mem_page_table_t *(*table_alloc_func)(void), bool writable);
 bool mem_unmap_page(virt_addr_t virt_addr);
 
+// Memory types of a mapping, selected with the PAT, PCD and PWT bits of its entries
+typedef enum mem_cache_mode_t {
+	MEM_CACHE_WRITE_BACK,
+	MEM_CACHE_WRITE_THROUGH,
+	MEM_CACHE_WRITE_COMBINING, // Uncached if the CPU has no PAT
+	MEM_CACHE_UNCACHED,
+	MEM_NUM_CACHE_MODES,
+} mem_cache_mode_t;
+
+// Range versions, the TLB is flushed once for the whole range
+// Map num_pages pages to the contiguous frames starting at physical_addr
+bool mem_map_range(uint32_t physical_addr, virt_addr_t virt_addr, uint32_t num_pages, mem_page_table_t *(*table_alloc_func)(void), bool writable);
+// Same as mem_map_range with a memory type other than write-back, for device memory
+bool mem_map_range_cache_mode(uint32_t physical_addr, virt_addr_t virt_addr, uint32_t num_pages, mem_page_table_t *(*table_alloc_func)(void), bool writable, mem_cache_mode_t cache_mode);
+// Change the memory type of pages that are already mapped, returns the number of pages changed
+// A frame mapped with a new type must not keep aliases with another type
+uint32_t mem_set_range_cache_mode(virt_addr_t virt_addr, uint32_t num_pages, mem_cache_mode_t cache_mode);
+// Map num_pages pages to frames allocated from zone in runs (they don't need to be contiguous)
+// On failure nothing stays mapped or allocated
+bool mem_map_range_alloc(virt_addr_t virt_addr, uint32_t num_pages, mem_zone_t zone, mem_page_table_t *(*table_alloc_func)(void), bool writable);
+// Reserve num_pages pages that get a zeroed frame from zone on first access (see mem_handle_page_fault)
+bool mem_map_range_demand_zero(virt_addr_t virt_addr, uint32_t num_pages, mem_zone_t zone, mem_page_table_t *(*table_alloc_func)(void), bool writable);
+// Returns the number of pages that were mapped or reserved, frees their frames if free_frames is true
+uint32_t mem_unmap_range(virt_addr_t virt_addr, uint32_t num_pages, bool free_frames);
+
+typedef struct mem_virt_range_t {
+	virt_addr_t virt_addr;
+	uint32_t num_pages;
+} mem_virt_range_t;
+
+// Unmap several ranges with a single TLB flush
+uint32_t mem_unmap_ranges(const mem_virt_range_t *ranges, uint32_t num_ranges, bool free_frames);
+
+// Called by the page fault handler, returns false if the fault is not a demand-zero page being accessed,
+// or if user code touched a kernel demand-zero page
+bool mem_handle_page_fault(uint32_t virt_addr, bool user_mode);
+
 void mem_print_virtual_memory_map(void);
 
 void *kbrk(k_size_t increment);
@@ -9,6 +9,7 @@
 static char g_shell_text_buffer[200];
 static int g_shell_text_length;
 static int g_shell_text_cursor;
+static mem_page_dir_table_t *g_dummy_user_page_dir_table;
 
 static void text_move_cursor_left() {
 	if (g_shell_text_cursor > 0) {
@@ -165,17 +166,24 @@ void shell_print_help() {
 	k_printf("  help\n");
 	k_printf("  clear\n");
 	k_printf("  echo [args...]\n");
-	k_printf("  stackdump, gdtdump, pmapdump, vmapdump, kmallocdump, vmallocdump\n");
+	k_printf("  stackdump, gdtdump, pmapdump, vmapdump, kmallocdump, cachedump, vmallocdump, arenadump\n");
 	k_printf("  kmalloc {size}, kfree {ptr}, ksize {ptr}, kbrk {size}\n");
-	k_printf("  vmalloc {size}, vfree {ptr}, vsize {ptr}, vbrk {size}\n");
+	k_printf("  vmalloc {size}, vmalloclazy {size}, vfree {ptr}, vsize {ptr}, vbrk {size}, vpurge\n");
+	k_printf("  kvmalloc {size}, kvfree {ptr}\n");
 	k_printf("  kernelmode\n");
 	k_printf("  dummyusermode\n");
 	k_printf("  shutdown\n");
 }
 
 void shell_loop() {
-	char buff[k_array_count(g_shell_text_buffer)];
+	k_arena_t *scratch = k_get_scratch_arena();
 	while (true) {
+		k_arena_reset_to(scratch, (k_arena_mark_t){0});
+
+		// The arena keeps its first chunk across resets, so this only allocates once
+		char *buff = k_arena_alloc(scratch, sizeof(g_shell_text_buffer));
+		k_assert(buff != NULL, "Could not allocate the shell buffer");
+
 		int len = shell_prompt(buff);
 
 		k_size_t cmd_idx = 0, cmd_len = 0;
@@ -183,22 +191,34 @@ void shell_loop() {
 		const char *cmd = buff + cmd_idx;
 
 		if (cmd_len >= k_strlen("echo") && k_strncmp(cmd, "echo", cmd_len) == 0) {
-			bool first = true;
+			// Join the arguments with single spaces, then print the line at once
+			char *line = k_arena_alloc(scratch, len + 1);
+			if (!line) {
+				k_printf("Error: out of memory\n");
+				continue;
+			}
+
+			k_size_t line_len = 0;
 			k_size_t arg_idx = cmd_idx + cmd_len, arg_len = 0;
 			while (arg_idx < len) {
-				if (!first) {
-					k_printf(" ");
+				get_next_arg(buff, len, &arg_idx, &arg_len);
+				if (arg_len <= 0) {
+					break;
 				}
 
-				first = false;
+				if (line_len > 0) {
+					line[line_len] = ' ';
+					line_len += 1;
+				}
 
-				get_next_arg(buff, len, &arg_idx, &arg_len);
-				k_printf("%S", arg_len, buff + arg_idx);
+				k_memcpy(line + line_len, buff + arg_idx, arg_len);
+				line_len += arg_len;
 
 				arg_idx += arg_len;
 			}
 
-			k_printf("\n");
+			line[line_len] = '\n';
+			k_printf("%S", line_len + 1, line);
 		} else if (cmd_len >= k_strlen("clear") && k_strncmp(cmd, "clear", cmd_len) == 0) {
 			tty_clear(0);
 		} else if (cmd_len >= k_strlen("help") && k_strncmp(cmd, "help", cmd_len) == 0) {
@@ -219,8 +239,12 @@ void shell_loop() {
 			mem_print_virtual_memory_map();
 		} else if (cmd_len >= k_strlen("kmallocdump") && k_strncmp(cmd, "kmallocdump", cmd_len) == 0) {
 			kmalloc_print_info();
+		} else if (cmd_len >= k_strlen("cachedump") && k_strncmp(cmd, "cachedump", cmd_len) == 0) {
+			kmem_cache_print_info();
 		} else if (cmd_len >= k_strlen("vmallocdump") && k_strncmp(cmd, "vmallocdump", cmd_len) == 0) {
 			vmalloc_print_info();
+		} else if (cmd_len >= k_strlen("arenadump") && k_strncmp(cmd, "arenadump", cmd_len) == 0) {
+			k_arena_print_info(scratch, "scratch");
 		} else if (cmd_len >= k_strlen("shutdown") && k_strncmp(cmd, "shutdown", cmd_len) == 0) {
 			k_printf("Shutting down\n");
 			ioport_write_word(0x604, 0x2000);
@@ -255,6 +279,27 @@ void shell_loop() {
 
 			void *ptr = (void *)k_str_to_uint32(buff + arg_idx, arg_len);
 			k_printf("ksize %p: %d\n", ptr, ksize(ptr));
+		} else if (cmd_len >= k_strlen("kvmalloc") && k_strncmp(cmd, "kvmalloc", cmd_len) == 0) {
+			k_size_t arg_idx = cmd_idx + cmd_len, arg_len = 0;
+			get_next_arg(buff, len, &arg_idx, &arg_len);
+			if (arg_len <= 0) {
+				k_printf("Error: expected argument\n");
+				continue;
+			}
+
+			uint32_t size = k_str_to_uint32(buff + arg_idx, arg_len);
+			void *ptr = kvmalloc(size);
+			k_printf("kvmalloc: %p, requested %d bytes, got %d\n", ptr, size, kvsize(ptr));
+		} else if (cmd_len >= k_strlen("kvfree") && k_strncmp(cmd, "kvfree", cmd_len) == 0) {
+			k_size_t arg_idx = cmd_idx + cmd_len, arg_len = 0;
+			get_next_arg(buff, len, &arg_idx, &arg_len);
+			if (arg_len <= 0) {
+				k_printf("Error: expected argument\n");
+				continue;
+			}
+
+			void *ptr = (void *)k_str_to_uint32(buff + arg_idx, arg_len);
+			kvfree(ptr);
 		} else if (cmd_len >= k_strlen("kbrk") && k_strncmp(cmd, "kbrk", cmd_len) == 0) {
 			k_size_t arg_idx = cmd_idx + cmd_len, arg_len = 0;
 			get_next_arg(buff, len, &arg_idx, &arg_len);
@@ -282,6 +327,17 @@ void shell_loop() {
 			uint32_t size = k_str_to_uint32(buff + arg_idx, arg_len);
 			void *ptr = vmalloc(size);
 			k_printf("vmalloc: %p, requested %d bytes, got %d\n", ptr, size, vsize(ptr));
+		} else if (cmd_len >= k_strlen("vmalloclazy") && k_strncmp(cmd, "vmalloclazy", cmd_len) == 0) {
+			k_size_t arg_idx = cmd_idx + cmd_len, arg_len = 0;
+			get_next_arg(buff, len, &arg_idx, &arg_len);
+			if (arg_len <= 0) {
+				k_printf("Error: expected argument\n");
+				continue;
+			}
+
+			uint32_t size = k_str_to_uint32(buff + arg_idx, arg_len);
+			void *ptr = vmalloc_lazy(size);
+			k_printf("vmalloclazy: %p, requested %d bytes, got %d\n", ptr, size, vsize(ptr));
 		} else if (cmd_len >= k_strlen("vfree") && k_strncmp(cmd, "vfree", cmd_len) == 0) {
 			k_size_t arg_idx = cmd_idx + cmd_len, arg_len = 0;
 			get_next_arg(buff, len, &arg_idx, &arg_len);
@@ -292,6 +348,8 @@ void shell_loop() {
 
 			void *ptr = (void *)k_str_to_uint32(buff + arg_idx, arg_len);
 			vfree(ptr);
+		} else if (cmd_len >= k_strlen("vpurge") && k_strncmp(cmd, "vpurge", cmd_len) == 0) {
+			vmalloc_purge();
 		} else if (cmd_len >= k_strlen("vsize") && k_strncmp(cmd, "vsize", cmd_len) == 0) {
 			k_size_t arg_idx = cmd_idx + cmd_len, arg_len = 0;
 			get_next_arg(buff, len, &arg_idx, &arg_len);
@@ -322,7 +380,15 @@ void shell_loop() {
 			mem_switch_to_kernel_mode();
 		} else if (cmd_len >= k_strlen("dummyusermode") && k_strncmp(cmd, "dummyusermode", cmd_len) == 0) {
 			mem_page_dir_table_t *dir = mem_create_default_page_dir_table(true);
-			mem_change_page_dir_table(dir);
+			if (dir) {
+				mem_change_page_dir_table(dir);
+
+				// Only keep the last one
+				mem_destroy_page_dir_table(g_dummy_user_page_dir_table);
+				g_dummy_user_page_dir_table = dir;
+			} else {
+				k_printf("Could not create page directory\n");
+			}
 		} else if (cmd_len > 0) {
 			k_printf("\x1b[31mError\x1b[0m: unknown command '\x1b[31m%S\x1b[0m'\n", cmd_len, cmd);
 		}
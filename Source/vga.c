@@ -1,7 +1,29 @@
 #include "vga.h"
 #include "ioport.h"
+#include "alloc.h"
 
-static uint16_t *g_vga_buff = (uint16_t *)0xb8000;
+#define VGA_BUFFER_PHYS_ADDR 0xb8000
+
+// Accessed through the identity mapping until vga_remap_buffer is called
+static uint16_t *g_vga_buff = (uint16_t *)VGA_BUFFER_PHYS_ADDR;
+
+// Write-combining batches the writes of a whole line into a few bus transactions
+void vga_remap_buffer(void) {
+	k_size_t size = VGA_WIDTH * VGA_HEIGHT * sizeof(uint16_t);
+	uint32_t num_pages = k_align_forward(size, MEM_PAGE_SIZE) / MEM_PAGE_SIZE;
+
+	// The identity and kernel linear mappings of the buffer get the same memory type first
+	mem_set_range_cache_mode(make_virt_addr(VGA_BUFFER_PHYS_ADDR), num_pages, MEM_CACHE_WRITE_COMBINING);
+	mem_set_range_cache_mode(make_virt_addr(KERNEL_VIRT_START + VGA_BUFFER_PHYS_ADDR), num_pages, MEM_CACHE_WRITE_COMBINING);
+
+	uint16_t *buff = ioremap(VGA_BUFFER_PHYS_ADDR, size, MEM_CACHE_WRITE_COMBINING);
+	if (!buff) {
+		k_printf("Could not remap the VGA buffer\n");
+		return;
+	}
+
+	g_vga_buff = buff;
+}
 
 vga_color_t vga_color_get_fg(uint8_t c) {
 	return c & 0xf;
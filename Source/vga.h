@@ -32,6 +32,8 @@ uint8_t vga_entry_color(vga_color_t fg, vga_color_t bg);
 uint16_t vga_entry(char c, uint8_t color);
 uint16_t vga_get_entry_at(int col, int row);
 void vga_set_entry_at(int col, int row, uint16_t entry);
+// Map the buffer write-combining in vmalloc space, once vmalloc is initialized
+void vga_remap_buffer(void);
 
 void vga_hide_cursor();
 void vga_show_cursor();
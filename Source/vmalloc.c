@@ -1,10 +1,31 @@
 #include "alloc.h"
 
+// Address spaces are kept both in lists (the free list is sorted by address) and in AVL
+// trees sorted by address, so that finding a space, its neighbours or a free space big
+// enough for an allocation is O(log n). Each node of the free tree knows the size of the
+// biggest free space in its subtree, which lets the search skip the subtrees that are
+// too small and return the lowest free space that fits (like Linux does for vmap areas).
+//
+// vfree is lazy: freed spaces are kept mapped on a purge list, and are unmapped all at
+// once with a single TLB flush when enough pages are waiting, or when we run out of
+// address space or frames.
+//
+// The nodes come from an object cache, and the nodes an operation needs are reserved
+// before it starts, so that it never fails or creates a slab halfway through. The slabs
+// of the cache are pages of a node area at the top of the vmalloc space, which is never
+// handed out, so the nodes never touch the kmalloc heap or kbrk.
+
 typedef struct vmalloc_addr_space_t {
 	struct vmalloc_addr_space_t *prev;
 	struct vmalloc_addr_space_t *next;
+	struct vmalloc_addr_space_t *parent;
+	struct vmalloc_addr_space_t *left;
+	struct vmalloc_addr_space_t *right;
 	uint32_t min;
 	uint32_t max;
+	uint32_t subtree_max_size;
+	int height;
+	bool is_vmap; // Maps frames that vmalloc does not own (vmap and ioremap)
 } vmalloc_addr_space_t;
 
 static
@@ -23,52 +44,297 @@ k_static_assert(sizeof(vmalloc_header_t) % 16 == 0);
 typedef struct vmalloc_heap_t {
 	void *brk;
 	vmalloc_addr_space_t *free_addr_space_list;
+	vmalloc_addr_space_t *free_addr_space_tree;
 	vmalloc_addr_space_t *occupied_addr_space_list;
+	vmalloc_addr_space_t *occupied_addr_space_tree;
+	vmalloc_addr_space_t *lazy_addr_space_list; // Freed, but not unmapped yet
+	uint32_t num_lazy_pages;
+
+	kmem_cache_t *node_cache;
+	uint32_t node_area_brk; // Next page of the node area to map
+	void *free_node_pages; // Given back by the cache but still mapped, linked through their first bytes
+	uint32_t num_node_pages;
 } vmalloc_heap_t;
 
+#define VMALLOC_NODE_AREA_SIZE (1024 * 1024)
+#define VMALLOC_NODE_AREA_START (VMALLOC_VIRT_END + 1 - VMALLOC_NODE_AREA_SIZE)
+
+#define VMALLOC_MIN_FREE_NODES 2 // The most nodes a single operation takes
+#define VMALLOC_MAX_LAZY_PAGES 1024 // Lazily freed pages that trigger a purge
+#define VMALLOC_PURGE_BATCH_SIZE 64
+
+// Make sure the next operation has the nodes it needs
+static
+bool refill_nodes(vmalloc_heap_t *heap) {
+	return kmem_cache_reserve(heap->node_cache, VMALLOC_MIN_FREE_NODES);
+}
+
 static
-vmalloc_addr_space_t *split_addr_space(vmalloc_addr_space_t **first, vmalloc_addr_space_t *space, uint32_t size) {
-	k_assert(size <= get_addr_space_size(space), "Address space range is to small");
+vmalloc_addr_space_t *alloc_node(vmalloc_heap_t *heap) {
+	vmalloc_addr_space_t *node = kmem_cache_alloc(heap->node_cache);
+	k_assert(node != NULL, "No free vmalloc node, refill_nodes was not called");
+
+	k_memset(node, 0, sizeof(*node));
 
-	if (get_addr_space_size(space) == size) {
-		return space;
+	return node;
+}
+
+static
+void free_node(vmalloc_heap_t *heap, vmalloc_addr_space_t *node) {
+	kmem_cache_free(heap->node_cache, node);
+}
+
+static
+int get_tree_height(vmalloc_addr_space_t *node) {
+	return node ? node->height : 0;
+}
+
+static
+uint32_t get_subtree_max_size(vmalloc_addr_space_t *node) {
+	return node ? node->subtree_max_size : 0;
+}
+
+static
+void tree_update_node(vmalloc_addr_space_t *node) {
+	node->height = 1 + k_max(get_tree_height(node->left), get_tree_height(node->right));
+
+	uint32_t max_size = get_addr_space_size(node);
+	max_size = k_max(max_size, get_subtree_max_size(node->left));
+	max_size = k_max(max_size, get_subtree_max_size(node->right));
+	node->subtree_max_size = max_size;
+}
+
+// Call when the size of a node changed, its position in the tree stays the same
+static
+void tree_update_up(vmalloc_addr_space_t *node) {
+	for (; node; node = node->parent) {
+		tree_update_node(node);
 	}
+}
 
-	vmalloc_addr_space_t *new_space = kmalloc(sizeof(vmalloc_addr_space_t));
-	if (!new_space) {
-		return NULL;
+static
+void tree_replace_child(vmalloc_addr_space_t **root, vmalloc_addr_space_t *parent, vmalloc_addr_space_t *old_child, vmalloc_addr_space_t *new_child) {
+	if (!parent) {
+		*root = new_child;
+	} else if (parent->left == old_child) {
+		parent->left = new_child;
+	} else {
+		parent->right = new_child;
+	}
+
+	if (new_child) {
+		new_child->parent = parent;
 	}
+}
 
-	k_memset(new_space, 0, sizeof(*new_space));
+static
+vmalloc_addr_space_t *tree_rotate_left(vmalloc_addr_space_t **root, vmalloc_addr_space_t *node) {
+	vmalloc_addr_space_t *right = node->right;
 
-	new_space->prev = space->prev;
-	if (new_space->prev) {
-		new_space->prev->next = new_space;
+	node->right = right->left;
+	if (node->right) {
+		node->right->parent = node;
 	}
 
-	new_space->next = space;
-	space->prev = new_space;
+	tree_replace_child(root, node->parent, node, right);
+	right->left = node;
+	node->parent = right;
 
-	new_space->min = space->min;
-	new_space->max = new_space->min + size - 1;
-	space->min = new_space->max + 1;
+	tree_update_node(node);
+	tree_update_node(right);
 
-	if (*first == space) {
-		*first = new_space;
+	return right;
+}
+
+static
+vmalloc_addr_space_t *tree_rotate_right(vmalloc_addr_space_t **root, vmalloc_addr_space_t *node) {
+	vmalloc_addr_space_t *left = node->left;
+
+	node->left = left->right;
+	if (node->left) {
+		node->left->parent = node;
+	}
+
+	tree_replace_child(root, node->parent, node, left);
+	left->right = node;
+	node->parent = left;
+
+	tree_update_node(node);
+	tree_update_node(left);
+
+	return left;
+}
+
+static
+void tree_rebalance_up(vmalloc_addr_space_t **root, vmalloc_addr_space_t *node) {
+	for (; node; node = node->parent) {
+		tree_update_node(node);
+
+		int balance = get_tree_height(node->left) - get_tree_height(node->right);
+		if (balance > 1) {
+			if (get_tree_height(node->left->left) < get_tree_height(node->left->right)) {
+				tree_rotate_left(root, node->left);
+			}
+
+			node = tree_rotate_right(root, node);
+		} else if (balance < -1) {
+			if (get_tree_height(node->right->right) < get_tree_height(node->right->left)) {
+				tree_rotate_right(root, node->right);
+			}
+
+			node = tree_rotate_left(root, node);
+		}
+	}
+}
+
+static
+void tree_insert(vmalloc_addr_space_t **root, vmalloc_addr_space_t *space) {
+	vmalloc_addr_space_t *parent = NULL;
+	vmalloc_addr_space_t **link = root;
+	while (*link) {
+		parent = *link;
+		link = space->min < parent->min ? &parent->left : &parent->right;
 	}
 
-	return new_space;
+	space->parent = parent;
+	space->left = NULL;
+	space->right = NULL;
+	*link = space;
+
+	tree_rebalance_up(root, space);
+}
+
+static
+void tree_remove(vmalloc_addr_space_t **root, vmalloc_addr_space_t *space) {
+	vmalloc_addr_space_t *rebalance_from;
+
+	if (!space->left || !space->right) {
+		vmalloc_addr_space_t *child = space->left ? space->left : space->right;
+		tree_replace_child(root, space->parent, space, child);
+		rebalance_from = space->parent;
+	} else {
+		// Put the next space in place of the removed one
+		vmalloc_addr_space_t *next = space->right;
+		while (next->left) {
+			next = next->left;
+		}
+
+		if (next->parent != space) {
+			rebalance_from = next->parent;
+			tree_replace_child(root, next->parent, next, next->right);
+
+			next->right = space->right;
+			next->right->parent = next;
+		} else {
+			rebalance_from = next;
+		}
+
+		next->left = space->left;
+		next->left->parent = next;
+		tree_replace_child(root, space->parent, space, next);
+	}
+
+	space->parent = NULL;
+	space->left = NULL;
+	space->right = NULL;
+
+	tree_rebalance_up(root, rebalance_from);
+}
+
+static
+vmalloc_addr_space_t *tree_find(vmalloc_addr_space_t *node, uint32_t min) {
+	while (node && node->min != min) {
+		node = min < node->min ? node->left : node->right;
+	}
+
+	return node;
+}
+
+// Last space that starts before addr
+static
+vmalloc_addr_space_t *tree_find_prev(vmalloc_addr_space_t *node, uint32_t addr) {
+	vmalloc_addr_space_t *prev = NULL;
+	while (node) {
+		if (node->min < addr) {
+			prev = node;
+			node = node->right;
+		} else {
+			node = node->left;
+		}
+	}
+
+	return prev;
+}
+
+// Lowest free space of at least size bytes
+static
+vmalloc_addr_space_t *tree_find_first_fit(vmalloc_addr_space_t *node, uint32_t size) {
+	if (get_subtree_max_size(node) < size) {
+		return NULL;
+	}
+
+	while (node) {
+		if (get_subtree_max_size(node->left) >= size) {
+			node = node->left;
+		} else if (get_addr_space_size(node) >= size) {
+			return node;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return NULL;
 }
 
 static vmalloc_heap_t g_vmalloc_heap;
 
+// Page source of the node cache, frames come straight from the frame allocator
+static
+void *alloc_node_page(void) {
+	vmalloc_heap_t *heap = &g_vmalloc_heap;
+
+	void *page = heap->free_node_pages;
+	if (page) {
+		heap->free_node_pages = *(void **)page;
+		return page;
+	}
+
+	if (heap->node_area_brk - VMALLOC_NODE_AREA_START >= VMALLOC_NODE_AREA_SIZE) {
+		return NULL;
+	}
+
+	if (!mem_map_range_alloc(make_virt_addr(heap->node_area_brk), 1, MEM_ZONE_HIGH, default_page_table_alloc, true)) {
+		return NULL;
+	}
+
+	page = (void *)heap->node_area_brk;
+	heap->node_area_brk += MEM_PAGE_SIZE;
+	heap->num_node_pages += 1;
+
+	return page;
+}
+
+static
+void free_node_page(void *page) {
+	vmalloc_heap_t *heap = &g_vmalloc_heap;
+
+	*(void **)page = heap->free_node_pages;
+	heap->free_node_pages = page;
+}
+
 void vmalloc_init(void) {
-	vmalloc_addr_space_t *base_addr_space = kmalloc(sizeof(vmalloc_addr_space_t));
-	k_memset(base_addr_space, 0, sizeof(*base_addr_space));
+	g_vmalloc_heap.node_area_brk = VMALLOC_NODE_AREA_START;
+	g_vmalloc_heap.node_cache = kmem_cache_create_with_page_source("vmalloc_addr_space_t", sizeof(vmalloc_addr_space_t), 0, NULL, alloc_node_page, free_node_page);
+	if (!g_vmalloc_heap.node_cache || !refill_nodes(&g_vmalloc_heap)) {
+		k_panic("Could not initialize vmalloc");
+	}
+
+	vmalloc_addr_space_t *base_addr_space = alloc_node(&g_vmalloc_heap);
 	base_addr_space->min = VMALLOC_VIRT_START;
-	base_addr_space->max = VMALLOC_VIRT_END;
+	base_addr_space->max = VMALLOC_NODE_AREA_START - 1;
 
 	g_vmalloc_heap.free_addr_space_list = base_addr_space;
+	tree_insert(&g_vmalloc_heap.free_addr_space_tree, base_addr_space);
 	g_vmalloc_heap.brk = (void *)VMALLOC_VIRT_START;
 }
 
@@ -105,6 +371,7 @@ void addr_space_insert_after(vmalloc_addr_space_t **first, vmalloc_addr_space_t
 		if (space->next) {
 			space->next->prev = space;
 		}
+		space->prev = NULL;
 
 		*first = space;
 	}
@@ -149,73 +416,146 @@ vmalloc_addr_space_t *addr_space_pop_front(vmalloc_addr_space_t **first) {
 }
 
 static
-virt_addr_t alloc_virt_addr_space(vmalloc_heap_t *heap, k_size_t size) {
-	vmalloc_addr_space_t *best_fit = NULL;
-	k_size_t best_fit_size = 0;
-	for (vmalloc_addr_space_t *space = heap->free_addr_space_list; space; space = space->next) {
-		k_size_t space_size = get_addr_space_size(space);
-		if (space_size > size) {
-			if (best_fit) {
-				if (space_size < best_fit_size) {
-					best_fit = space;
-					best_fit_size = space_size;
-				}
-			} else {
-				best_fit = space;
-				best_fit_size = space_size;
-			}
-		} else if (space_size == size) { // Can't get any better than that!
-			best_fit = space;
-			best_fit_size = space_size;
-			break;
-		}
+void insert_free_addr_space(vmalloc_heap_t *heap, vmalloc_addr_space_t *after, vmalloc_addr_space_t *space) {
+	addr_space_insert_after(&heap->free_addr_space_list, after, space);
+	tree_insert(&heap->free_addr_space_tree, space);
+}
+
+static
+void remove_free_addr_space(vmalloc_heap_t *heap, vmalloc_addr_space_t *space) {
+	addr_space_pop(&heap->free_addr_space_list, space);
+	tree_remove(&heap->free_addr_space_tree, space);
+}
+
+// Give the space back to the free list, merged with its free neighbours
+static
+void release_addr_space(vmalloc_heap_t *heap, vmalloc_addr_space_t *space) {
+	vmalloc_addr_space_t *prev = tree_find_prev(heap->free_addr_space_tree, space->min);
+	vmalloc_addr_space_t *next = prev ? prev->next : heap->free_addr_space_list;
+
+	if (next && space->max + 1 == next->min) {
+		space->max = next->max;
+		remove_free_addr_space(heap, next);
+		free_node(heap, next);
 	}
 
-	if (!best_fit) {
-		return make_virt_addr(0);
+	if (prev && prev->max + 1 == space->min) {
+		prev->max = space->max;
+		tree_update_up(prev);
+		free_node(heap, space);
+	} else {
+		insert_free_addr_space(heap, prev, space);
 	}
+}
 
-	vmalloc_addr_space_t *new_space = split_addr_space(&heap->free_addr_space_list, best_fit, size);
-	addr_space_pop(&heap->free_addr_space_list, new_space);
-	addr_space_push_front(&heap->occupied_addr_space_list, new_space);
+static
+void free_virt_addr_space(vmalloc_heap_t *heap, vmalloc_addr_space_t *space) {
+	addr_space_pop(&heap->occupied_addr_space_list, space);
+	tree_remove(&heap->occupied_addr_space_tree, space);
 
-	return make_virt_addr(new_space->min);
+	release_addr_space(heap, space);
 }
 
 static
-void coalesce_addr_space(vmalloc_addr_space_t **list, vmalloc_addr_space_t *start) {
-	vmalloc_addr_space_t *space = start ? start : *list;
-	while (space->next && space->max == space->next->min - 1) {
-		vmalloc_addr_space_t *next = space->next;
-		space->max = next->max;
-		if (next->next) {
-			next->next->prev = space;
+void purge_lazy_addr_spaces(vmalloc_heap_t *heap) {
+	while (heap->lazy_addr_space_list) {
+		mem_virt_range_t ranges[VMALLOC_PURGE_BATCH_SIZE];
+		uint32_t num_ranges = 0;
+		uint32_t num_pages = 0;
+		for (vmalloc_addr_space_t *space = heap->lazy_addr_space_list; space && num_ranges < VMALLOC_PURGE_BATCH_SIZE; space = space->next) {
+			ranges[num_ranges].virt_addr = make_virt_addr(space->min);
+			ranges[num_ranges].num_pages = get_addr_space_size(space) / MEM_PAGE_SIZE;
+			num_pages += ranges[num_ranges].num_pages;
+			num_ranges += 1;
+		}
+
+		uint32_t num_unmapped = mem_unmap_ranges(ranges, num_ranges, true);
+		k_assert(num_unmapped == num_pages, "Lazily freed space was not mapped");
+
+		for (uint32_t i = 0; i < num_ranges; i += 1) {
+			release_addr_space(heap, addr_space_pop_front(&heap->lazy_addr_space_list));
 		}
-		space->next = next->next;
 
-		kfree(next);
+		heap->num_lazy_pages -= num_pages;
 	}
 }
 
+// Spaces are page aligned, so only bigger alignments skip the start of a space
 static
-void free_virt_addr_space(vmalloc_heap_t *heap, vmalloc_addr_space_t *space) {
-	addr_space_pop(&heap->occupied_addr_space_list, space);
+virt_addr_t alloc_virt_addr_space(vmalloc_heap_t *heap, k_size_t size, k_size_t align) {
+	// Any free space that has align - page size more bytes has an aligned range that fits
+	uint32_t search_size = (uint32_t)size + (uint32_t)align - MEM_PAGE_SIZE;
+	if (search_size < (uint32_t)size || !refill_nodes(heap)) {
+		return make_virt_addr(0);
+	}
+
+	vmalloc_addr_space_t *free = tree_find_first_fit(heap->free_addr_space_tree, search_size);
+	if (!free && heap->lazy_addr_space_list) {
+		purge_lazy_addr_spaces(heap);
+		free = tree_find_first_fit(heap->free_addr_space_tree, search_size);
+	}
+
+	if (!free) {
+		return make_virt_addr(0);
+	}
+
+	uint32_t start = k_align_forward(free->min, (uint32_t)align);
+	uint32_t end = start + size - 1;
 
-	vmalloc_addr_space_t *insert_after = NULL;
-	for (vmalloc_addr_space_t *s = heap->free_addr_space_list; s; s = s->next) {
-		if (s->min > space->max) {
-			insert_after = s->prev;
-			break;
-		} else if (!s->next) {
-			insert_after = s;
+	vmalloc_addr_space_t *space = NULL;
+	if (start == free->min && end == free->max) {
+		remove_free_addr_space(heap, free);
+		space = free;
+	} else {
+		space = alloc_node(heap);
+
+		if (start == free->min) {
+			free->min = end + 1;
+		} else if (end == free->max) {
+			free->max = start - 1;
+		} else {
+			// The unaligned start of the space stays free, the end gets its own node
+			vmalloc_addr_space_t *tail = alloc_node(heap);
+			tail->min = end + 1;
+			tail->max = free->max;
+			free->max = start - 1;
+			insert_free_addr_space(heap, free, tail);
 		}
+
+		tree_update_up(free);
+
+		space->min = start;
+		space->max = end;
 	}
 
-	addr_space_insert_after(&heap->free_addr_space_list, insert_after, space);
-	coalesce_addr_space(&heap->free_addr_space_list, insert_after);
+	space->is_vmap = false;
+	addr_space_push_front(&heap->occupied_addr_space_list, space);
+	tree_insert(&heap->occupied_addr_space_tree, space);
+
+	return make_virt_addr(space->min);
 }
 
-void *vmalloc(k_size_t size) {
+// Lazily freed pages still hold their frames, they are given back before giving up
+static
+bool map_pages(vmalloc_heap_t *heap, virt_addr_t virt_addr, uint32_t num_pages, bool lazy) {
+	while (true) {
+		bool mapped;
+		if (lazy) {
+			mapped = mem_map_range_demand_zero(virt_addr, num_pages, MEM_ZONE_HIGH, default_page_table_alloc, true);
+		} else {
+			mapped = mem_map_range_alloc(virt_addr, num_pages, MEM_ZONE_HIGH, default_page_table_alloc, true);
+		}
+
+		if (mapped || !heap->lazy_addr_space_list) {
+			return mapped;
+		}
+
+		purge_lazy_addr_spaces(heap);
+	}
+}
+
+static
+void *vmalloc_internal(k_size_t size, bool lazy) {
 	if (size <= 0) {
 		return NULL;
 	}
@@ -223,85 +563,272 @@ void *vmalloc(k_size_t size) {
 	k_size_t size_with_header = size + sizeof(vmalloc_header_t);
 	size_with_header = k_align_forward(size_with_header, MEM_PAGE_SIZE);
 
-	virt_addr_t virt_start = alloc_virt_addr_space(&g_vmalloc_heap, size_with_header);
+	virt_addr_t virt_start = alloc_virt_addr_space(&g_vmalloc_heap, size_with_header, MEM_PAGE_SIZE);
 	if (!*(uint32_t *)&virt_start) {
 		return NULL;
 	}
 
-	virt_addr_t virt_addr = virt_start;
-
 	vmalloc_addr_space_t *space = g_vmalloc_heap.occupied_addr_space_list;
 
-	// Allocate blocks one by one (we don't need them to be contiguous)
-	// If we cannot allocate physical blocks, try to find blocks by searching in
-	// reverse and eating from memory usable by kbrk
-	bool reverse_search = false;
+	// Frames are allocated in runs of contiguous blocks, as big as the buddy allocator has,
+	// and several runs are taken at once (the pages don't need to be physically contiguous)
+	// The high zone falls back to eating memory usable by kbrk when it is exhausted
+	// Lazy allocations only reserve the pages, they get a frame each on first access
 	uint32_t num_pages = size_with_header / MEM_PAGE_SIZE;
-	uint32_t start_search_index = get_physical_block_index_of_addr(KERNEL_VIRT_LINEAR_MAPPING_END - KERNEL_VIRT_START);
-	uint32_t block_index = start_search_index;
-	for (uint32_t i = 0; i < num_pages; i += 1) {
-		uint32_t addr = mem_alloc_physical_blocks(1, block_index, reverse_search);
-		if (!addr && block_index >= start_search_index) {
-			reverse_search = true;
-			block_index = start_search_index - 1;
-			addr = mem_alloc_physical_blocks(1, block_index, reverse_search);
-		}
+	if (!map_pages(&g_vmalloc_heap, virt_start, num_pages, lazy)) {
+		free_virt_addr_space(&g_vmalloc_heap, space);
+		return NULL;
+	}
 
-		if (!addr) {
-			return NULL;
-		}
+	vmalloc_header_t *header = *(vmalloc_header_t **)&virt_start;
+	k_memset(header, 0, sizeof(*header));
 
-		if (reverse_search) {
-			block_index = get_physical_block_index_of_addr(addr) - 1;
-		} else {
-			block_index = get_physical_block_index_of_addr(addr) + 1;
+	header->addr_space = space;
+	header->size = size_with_header - sizeof(vmalloc_header_t);
+
+	return (void *)(header + 1);
+}
+
+void *vmalloc(k_size_t size) {
+	return vmalloc_internal(size, false);
+}
+
+void *vmalloc_lazy(k_size_t size) {
+	return vmalloc_internal(size, true);
+}
+
+void *vmalloc_aligned(k_size_t size, k_size_t align) {
+	k_assert(align > 0 && (align & (align - 1)) == 0, "Alignment is not a power of two");
+
+	if (size <= 0) {
+		return NULL;
+	}
+
+	size = k_align_forward(size, MEM_PAGE_SIZE);
+
+	virt_addr_t virt_start = alloc_virt_addr_space(&g_vmalloc_heap, size, k_max(align, MEM_PAGE_SIZE));
+	if (!*(uint32_t *)&virt_start) {
+		return NULL;
+	}
+
+	vmalloc_addr_space_t *space = g_vmalloc_heap.occupied_addr_space_list;
+
+	if (!map_pages(&g_vmalloc_heap, virt_start, size / MEM_PAGE_SIZE, false)) {
+		free_virt_addr_space(&g_vmalloc_heap, space);
+		return NULL;
+	}
+
+	return *(void **)&virt_start;
+}
+
+// Allocations with a header are never page aligned, page aligned ones have their address space looked up
+static
+vmalloc_addr_space_t *get_addr_space_of_ptr(vmalloc_heap_t *heap, void *ptr) {
+	if ((uint32_t)ptr % MEM_PAGE_SIZE != 0) {
+		vmalloc_header_t *header = (vmalloc_header_t *)ptr - 1;
+		k_assert(header->size > 0, "Invalid ptr");
+		k_assert((header->size + sizeof(vmalloc_header_t)) % MEM_PAGE_SIZE == 0, "Invalid ptr");
+
+		return header->addr_space;
+	}
+
+	vmalloc_addr_space_t *space = tree_find(heap->occupied_addr_space_tree, (uint32_t)ptr);
+	if (!space) {
+		k_panic("Invalid ptr");
+	}
+
+	return space;
+}
+
+void vfree(void *ptr) {
+	if (!ptr) {
+		return;
+	}
+
+	vmalloc_heap_t *heap = &g_vmalloc_heap;
+	vmalloc_addr_space_t *space = get_addr_space_of_ptr(heap, ptr);
+	k_assert(!space->is_vmap, "Freeing a vmap area, use vunmap");
+
+	// The header stays mapped until the purge, clearing it catches double frees
+	if ((uint32_t)ptr % MEM_PAGE_SIZE != 0) {
+		((vmalloc_header_t *)ptr - 1)->size = 0;
+	}
+
+	addr_space_pop(&heap->occupied_addr_space_list, space);
+	tree_remove(&heap->occupied_addr_space_tree, space);
+
+	addr_space_push_front(&heap->lazy_addr_space_list, space);
+	heap->num_lazy_pages += get_addr_space_size(space) / MEM_PAGE_SIZE;
+
+	if (heap->num_lazy_pages >= VMALLOC_MAX_LAZY_PAGES) {
+		purge_lazy_addr_spaces(heap);
+	}
+}
+
+void vmalloc_purge(void) {
+	purge_lazy_addr_spaces(&g_vmalloc_heap);
+}
+
+// Consecutive frames are mapped together, so a physically contiguous buffer takes a single range
+void *vmap(const uint32_t *frames, uint32_t num_frames, bool writable) {
+	if (num_frames == 0) {
+		return NULL;
+	}
+
+	// More frames than vmalloc space could hold, the size would also wrap around
+	if (num_frames > (VMALLOC_VIRT_END - VMALLOC_VIRT_START) / MEM_PAGE_SIZE) {
+		return NULL;
+	}
+
+	vmalloc_heap_t *heap = &g_vmalloc_heap;
+	virt_addr_t virt_start = alloc_virt_addr_space(heap, num_frames * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+	if (!*(uint32_t *)&virt_start) {
+		return NULL;
+	}
+
+	vmalloc_addr_space_t *space = heap->occupied_addr_space_list;
+	space->is_vmap = true;
+
+	uint32_t i = 0;
+	while (i < num_frames) {
+		k_assert(frames[i] % MEM_PAGE_SIZE == 0, "Frame is not page aligned");
+
+		uint32_t run_length = 1;
+		while (i + run_length < num_frames && frames[i + run_length] == frames[i] + run_length * MEM_PAGE_SIZE) {
+			run_length += 1;
 		}
 
-		if (!mem_map_page(addr, virt_addr, default_page_table_alloc, true)) {
+		virt_addr_t virt_addr = make_virt_addr(space->min + i * MEM_PAGE_SIZE);
+		if (!mem_map_range(frames[i], virt_addr, run_length, default_page_table_alloc, writable)) {
+			// The frames are not ours, only undo the mappings
+			mem_unmap_range(virt_start, i, false);
+			free_virt_addr_space(heap, space);
 			return NULL;
 		}
 
-		virt_addr = make_virt_addr(*(uint32_t *)&virt_addr + MEM_PAGE_SIZE);
+		i += run_length;
 	}
 
-	vmalloc_header_t *header = *(vmalloc_header_t **)&virt_start;
-	k_memset(header, 0, sizeof(*header));
+	return *(void **)&virt_start;
+}
 
-	header->addr_space = space;
-	header->size = size_with_header - sizeof(vmalloc_header_t);
+// Not lazy, the caller can reuse the frames as soon as it returns
+void vunmap(void *ptr) {
+	if (!ptr) {
+		return;
+	}
 
-	return (void *)(header + 1);
+	vmalloc_heap_t *heap = &g_vmalloc_heap;
+	k_assert((uint32_t)ptr % MEM_PAGE_SIZE == 0, "Invalid ptr");
+
+	vmalloc_addr_space_t *space = get_addr_space_of_ptr(heap, ptr);
+	k_assert(space->is_vmap, "Not a vmap area, use vfree");
+
+	uint32_t num_pages = get_addr_space_size(space) / MEM_PAGE_SIZE;
+	uint32_t num_unmapped = mem_unmap_range(make_virt_addr(space->min), num_pages, false);
+	k_assert(num_unmapped == num_pages, "vmap area was not mapped");
+
+	free_virt_addr_space(heap, space);
 }
 
-void vfree(void *ptr) {
+// Device memory is mapped as is, page by page around the requested range
+void *ioremap(uint32_t physical_addr, k_size_t size, mem_cache_mode_t cache_mode) {
+	if (size <= 0) {
+		return NULL;
+	}
+
+	uint32_t offset = physical_addr % MEM_PAGE_SIZE;
+	uint32_t num_pages = k_align_forward(offset + (uint32_t)size, MEM_PAGE_SIZE) / MEM_PAGE_SIZE;
+
+	vmalloc_heap_t *heap = &g_vmalloc_heap;
+	virt_addr_t virt_start = alloc_virt_addr_space(heap, num_pages * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+	if (!*(uint32_t *)&virt_start) {
+		return NULL;
+	}
+
+	vmalloc_addr_space_t *space = heap->occupied_addr_space_list;
+	space->is_vmap = true;
+
+	if (!mem_map_range_cache_mode(physical_addr - offset, virt_start, num_pages, default_page_table_alloc, true, cache_mode)) {
+		free_virt_addr_space(heap, space);
+		return NULL;
+	}
+
+	return (uint8_t *)*(void **)&virt_start + offset;
+}
+
+void iounmap(void *ptr) {
 	if (!ptr) {
 		return;
 	}
 
-	vmalloc_header_t *header = (vmalloc_header_t *)ptr - 1;
-	k_assert(header->size > 0, "Invalid ptr");
-	k_assert((header->size + sizeof(vmalloc_header_t)) % MEM_PAGE_SIZE == 0, "Invalid ptr");
+	vunmap((void *)((uint32_t)ptr & ~(uint32_t)(MEM_PAGE_SIZE - 1)));
+}
+
+// Extend the occupied space with the start of the free space that follows it, if it is big enough
+static
+bool grow_virt_addr_space(vmalloc_heap_t *heap, vmalloc_addr_space_t *space, uint32_t increment) {
+	vmalloc_addr_space_t *next = tree_find(heap->free_addr_space_tree, space->max + 1);
+	if (!next || get_addr_space_size(next) < increment) {
+		return false;
+	}
+
+	if (!mem_map_range_alloc(make_virt_addr(next->min), increment / MEM_PAGE_SIZE, MEM_ZONE_HIGH, default_page_table_alloc, true)) {
+		return false;
+	}
+
+	space->max += increment;
+	tree_update_up(space);
+
+	if (get_addr_space_size(next) == increment) {
+		remove_free_addr_space(heap, next);
+		free_node(heap, next);
+	} else {
+		next->min += increment;
+		tree_update_up(next);
+	}
+
+	return true;
+}
 
-	mem_page_dir_table_t *dir = mem_get_current_page_dir_table();
-	uint32_t addr = (uint32_t)header;
-	for (uint32_t i = 0; i < (uint32_t)header->size; i += MEM_PAGE_SIZE) {
-		virt_addr_t virt_addr = make_virt_addr(addr + i);
+void *vrealloc(void *ptr, k_size_t size) {
+	if (!ptr) {
+		return vmalloc(size);
+	}
 
-		mem_page_dir_entry_t *dir_entry = mem_get_page_dir_entry(dir, virt_addr);
-		k_assert(dir_entry->is_present_in_physical_memory, "");
+	if (size <= 0) {
+		vfree(ptr);
+		return NULL;
+	}
+
+	k_size_t old_size = vsize(ptr);
+	if (size <= old_size) {
+		return ptr;
+	}
 
-		uint32_t page_table_phys_addr = dir_entry->page_table_physical_addr_4KiB * MEM_PAGE_SIZE;
-		mem_page_table_t *page_table = (mem_page_table_t *)page_table_phys_addr;
-		mem_page_table_entry_t *table_entry = mem_get_page_table_entry(page_table, virt_addr);
-		k_assert(table_entry->is_present_in_physical_memory, "");
+	vmalloc_addr_space_t *space = get_addr_space_of_ptr(&g_vmalloc_heap, ptr);
+	k_assert(!space->is_vmap, "Reallocating a vmap area");
+	bool is_aligned = (uint32_t)ptr % MEM_PAGE_SIZE == 0;
+	k_size_t header_size = is_aligned ? 0 : sizeof(vmalloc_header_t);
+	k_size_t new_space_size = k_align_forward(size + header_size, MEM_PAGE_SIZE);
+	if (grow_virt_addr_space(&g_vmalloc_heap, space, new_space_size - get_addr_space_size(space))) {
+		if (!is_aligned) {
+			((vmalloc_header_t *)ptr - 1)->size = new_space_size - header_size;
+		}
 
-		uint32_t phys_addr = table_entry->physical_addr_4KiB * MEM_PAGE_SIZE;
-		mem_free_physical_blocks(phys_addr, 1);
+		return ptr;
+	}
 
-		mem_unmap_page(virt_addr);
+	// Moving keeps page alignment only, a bigger alignment is not known here
+	void *new_ptr = is_aligned ? vmalloc_aligned(size, MEM_PAGE_SIZE) : vmalloc(size);
+	if (!new_ptr) {
+		return NULL;
 	}
 
-	free_virt_addr_space(&g_vmalloc_heap, header->addr_space);
+	k_memcpy(new_ptr, ptr, old_size);
+	vfree(ptr);
+
+	return new_ptr;
 }
 
 k_size_t vsize(void *ptr) {
@@ -309,6 +836,10 @@ k_size_t vsize(void *ptr) {
 		return 0;
 	}
 
+	if ((uint32_t)ptr % MEM_PAGE_SIZE == 0) {
+		return get_addr_space_size(get_addr_space_of_ptr(&g_vmalloc_heap, ptr));
+	}
+
 	vmalloc_header_t *header = (vmalloc_header_t *)ptr - 1;
 
 	return header->size;
@@ -329,18 +860,21 @@ void *vbrk(k_size_t increment) {
 		return NULL;
 	}
 
+	if (!refill_nodes(heap)) {
+		return NULL;
+	}
+
 	k_printf("Incrementing vbrk by %d bytes\n", increment);
 
 	if (heap->free_addr_space_list && heap->free_addr_space_list->min == brk) {
 		heap->free_addr_space_list->min -= increment;
+		tree_update_up(heap->free_addr_space_list);
 	} else {
-		vmalloc_addr_space_t *space = kmalloc(sizeof(vmalloc_addr_space_t));
-		k_memset(space, 0, sizeof(*space));
-
+		vmalloc_addr_space_t *space = alloc_node(heap);
 		space->min = brk - increment;
 		space->max = brk - 1;
 
-		addr_space_insert_after(&heap->free_addr_space_list, NULL, space);
+		insert_free_addr_space(heap, NULL, space);
 	}
 
 	heap->brk = (uint8_t *)heap->brk - increment;
@@ -367,4 +901,7 @@ void vmalloc_print_info(void) {
 	}
 
 	k_printf("\nTotal allocated: %n\n", total_allocated_bytes);
+	k_printf("Lazily freed: %n, waiting to be purged\n", g_vmalloc_heap.num_lazy_pages * MEM_PAGE_SIZE);
+	k_printf("Node area: %n mapped out of %n\n", g_vmalloc_heap.num_node_pages * MEM_PAGE_SIZE, VMALLOC_NODE_AREA_SIZE);
+	k_printf("Tree heights: %d free, %d occupied\n", get_tree_height(g_vmalloc_heap.free_addr_space_tree), get_tree_height(g_vmalloc_heap.occupied_addr_space_tree));
 }